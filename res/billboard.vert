@@ -1,10 +1,9 @@
 #version 460 core
 
-#define RADIUS 0.4
-
 layout(location = 0) uniform mat4 proj;
 layout(location = 1) uniform mat4 view;
 
+/* xyz is the center and w the radius of a ball */
 layout(binding = 2, std430) readonly buffer color_positions {
     vec4 positions[];
 };
@@ -35,12 +34,13 @@ void main() {
     float g = (color >> 8u) & 255u;
     float b = color & 255u;
     vs_rgb = vec3(r, g, b) / 255.0;
+    float radius = positions[i].w;
     mat4 model = mat4(1.0);
-    model[3] = positions[i];
+    model[3] = vec4(positions[i].xyz, 1.0f);
     mat4 mv = view * model;
-    mv[0] = vec4(RADIUS, 0.0f, 0.0f, 0.0f);
-    mv[1] = vec4(0.0f, RADIUS, 0.0f, 0.0f);
-    mv[2] = vec4(0.0f, RADIUS, RADIUS, 0.0f);
+    mv[0] = vec4(radius, 0.0f, 0.0f, 0.0f);
+    mv[1] = vec4(0.0f, radius, 0.0f, 0.0f);
+    mv[2] = vec4(0.0f, radius, radius, 0.0f);
     vec2 pos = uv * 2.0f - 1.0f; 
     gl_Position = proj * mv * vec4(pos, 0.0f, 1.0f); 
 }
@@ -1,100 +1,103 @@
-#define N_BALLS 4096
-#define RADIUS 0.4f
-#define DIAMETER 0.8f
-#define SPS 600
+/* 
+ * N_BALLS, GRID_LEN, RADIUS, DIAMETER, SPS, BALL_IDX and STRIDE are passed
+ * as build options, vectors are stored as structure of arrays with the
+ * components STRIDE floats apart, the program is built once per pass with 
+ * the stencil of the pass in TX to IZ
+ */
 #define DT (1.0f / SPS)
-#define GRID_LEN 32
 #define GRID_MIN (RADIUS - GRID_LEN / 2)
 #define GRID_MAX (GRID_LEN / 2 - RADIUS)
+#define CELL(x, y, z) (((x) * GRID_LEN + (y)) * GRID_LEN + (z))
 
-struct sim {
-    float3 x[N_BALLS];
-    float3 v[N_BALLS];
-    float3 x0[N_BALLS];
-    short nodes[N_BALLS];
-    short grid[GRID_LEN][GRID_LEN][GRID_LEN];
-    short tx, ty, tz;
-    short px, py, pz;
-    short nx, ny, nz;
-    short ix, iy, iz;
-};
+static float3 load(__global const float *a, int i) {
+    return (float3) (a[i], a[STRIDE + i], a[2 * STRIDE + i]);
+}
+
+static void store(__global float *a, int i, float3 v) {
+    a[i] = v.x;
+    a[STRIDE + i] = v.y;
+    a[2 * STRIDE + i] = v.z;
+}
 
-static void resolve_ball_ball_collision(__global struct sim *sim, int i, int j) {
-    float3 normal = sim->x[i] - sim->x[j];
+static void resolve_ball_ball_collision(__global float *x, 
+                                        __global float *v, int i, int j) {
+    float3 xi = load(x, i);
+    float3 xj = load(x, j);
+    float3 normal = xi - xj;
     float d2 = dot(normal, normal);
     if (d2 > 0.0f && d2 < DIAMETER * DIAMETER) {
         float d = sqrt(d2);
         normal = normal / d;
         float corr = (DIAMETER - d) / 2.0f;
         float3 dx = normal * corr;
-        sim->x[i] += dx;
-        sim->x[j] -= dx;
-        float vi = dot(sim->v[i], normal);
-        float vj = dot(sim->v[j], normal);
-        float3 dv = normal * (vi - vj);
-        sim->v[i] -= dv;
-        sim->v[j] += dv;
+        store(x, i, xi + dx);
+        store(x, j, xj - dx);
+        float3 vi = load(v, i);
+        float3 vj = load(v, j);
+        float3 dv = normal * (dot(vi, normal) - dot(vj, normal));
+        store(v, i, vi - dv);
+        store(v, j, vj + dv);
     }
 }
 
-void resolve_tile_tile_collisions(__global struct sim *sim, int i0, int j0) {
-    for (int i = i0; i >= 0; i = sim->nodes[i]) {
-        if (i0 == j0) {
-            for (int j = sim->nodes[i]; j >= 0; j = sim->nodes[j]) {
-                resolve_ball_ball_collision(sim, i, j);
-            }
-        } else {
-            for (int j = j0; j >= 0; j = sim->nodes[j]) {
-                resolve_ball_ball_collision(sim, i, j);
-            }
+void resolve_tile_tile_collisions(__global float *x, __global float *v, 
+                                  __global const BALL_IDX *cell_start, 
+                                  __global const BALL_IDX *sorted, 
+                                  int c0, int c1) {
+    int i0 = cell_start[c0];
+    int i1 = cell_start[c0 + 1];
+    int j0 = cell_start[c1];
+    int j1 = cell_start[c1 + 1];
+    for (int k = i0; k < i1; k++) {
+        int l = c0 == c1 ? k + 1 : j0;
+        int n = c0 == c1 ? i1 : j1;
+        for (; l < n; l++) {
+            resolve_ball_ball_collision(x, v, sorted[k], sorted[l]);
         }
     }
 }
 
-__kernel void resolve_pair_collisions(__global struct sim *sim) {
+__kernel void resolve_pair_collisions(__global float *x, 
+                                      __global float *v, 
+                                      __global const BALL_IDX *cell_start, 
+                                      __global const BALL_IDX *sorted) {
     int i0 = get_global_id(0);
     int n0 = get_global_size(0);
-    int lx = (GRID_LEN - sim->px - sim->nx + sim->ix - 1) / sim->ix;
-    int xi = i0 * lx / n0 * sim->ix + sim->px;
-    int xf = (i0 + 1) * lx / n0 * sim->ix + sim->px;
-    //int yi = sim->py;
-    //int yf = GRID_LEN - sim->ny; 
+    int lx = (GRID_LEN - PX - NX + IX - 1) / IX;
+    int xi = i0 * lx / n0 * IX + PX;
+    int xf = (i0 + 1) * lx / n0 * IX + PX;
     int i1 = get_global_id(1);
     int n1  = get_global_size(1);
-    int ly = (GRID_LEN - sim->py - sim->ny + sim->iy - 1) / sim->iy;
-    int yi = i1 * ly / n1 * sim->iy + sim->py;
-    int yf = (i1 + 1) * ly / n1 * sim->iy + sim->py;
+    int ly = (GRID_LEN - PY - NY + IY - 1) / IY;
+    int yi = i1 * ly / n1 * IY + PY;
+    int yf = (i1 + 1) * ly / n1 * IY + PY;
     int i2 = get_global_id(2);
     int n2 = get_global_size(2);
-    int lz = (GRID_LEN - sim->pz - sim->nz + sim->iz - 1) / sim->iz;
-    int zi = i2 * lz / n1 * sim->iz + sim->pz;
-    int zf = (i2 + 1) * lz / n2 * sim->iz + sim->pz;
-    int ix = sim->ix;
-    int iy = sim->iy;
-    int iz = sim->iz;
-    for (int x = xi; x < xf; x += ix) {
-        for (int y = yi; y < yf; y += iy) {
-            for (int z = zi; z < zf; z += iz) {
-                int i = sim->grid[x][y][z];
-                int j = sim->grid[x + sim->tx][y + sim->ty][z + sim->tz];
-                resolve_tile_tile_collisions(sim, i, j);
+    int lz = (GRID_LEN - PZ - NZ + IZ - 1) / IZ;
+    int zi = i2 * lz / n1 * IZ + PZ;
+    int zf = (i2 + 1) * lz / n2 * IZ + PZ;
+    for (int x0 = xi; x0 < xf; x0 += IX) {
+        for (int y0 = yi; y0 < yf; y0 += IY) {
+            for (int z0 = zi; z0 < zf; z0 += IZ) {
+                int c0 = CELL(x0, y0, z0);
+                int c1 = c0 + CELL(TX, TY, TZ);
+                resolve_tile_tile_collisions(x, v, cell_start, sorted, c0, c1);
             }
         }
     }
 }
 
-__kernel void symplectic_euler(__global struct sim *sim) {
+__kernel void symplectic_euler(__global float *x, __global float *v) {
     int worker_idx = get_global_id(0);
     int n_workers = get_global_size(0);
     int i = worker_idx * N_BALLS / n_workers;
     int n = (worker_idx + 1) * N_BALLS / n_workers;
     for (; i < n; i++) {
-        sim->v[i].y -= 10.0f * DT;
-        float3 x0 = sim->x[i];
-        sim->x[i] += sim->v[i] * DT;
-        sim->x[i].x = clamp(sim->x[i].x, GRID_MIN, GRID_MAX);
-        sim->x[i].y = clamp(sim->x[i].y, GRID_MIN, GRID_MAX);
-        sim->x[i].z = clamp(sim->x[i].z, GRID_MIN, GRID_MAX);
-        sim->v[i] = (sim->x[i] - x0) * SPS;
+        float3 vi = load(v, i);
+        float3 x0 = load(x, i);
+        vi.y -= 10.0f * DT;
+        float3 xi = clamp(x0 + vi * DT, GRID_MIN, GRID_MAX);
+        store(x, i, xi);
+        store(v, i, (xi - x0) * SPS);
     }
 }
@@ -1,10 +1,24 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <assert.h>
 #include "sim.h"
+#include "misc.h"
 #include "worker.h"
 
 #define IS_LONG(v) _Generic((v), long: 1, default: 0)
+#define SUB_BUCKETS 16
+#define N_BUCKETS (60 * SUB_BUCKETS)
+
+/* 
+ * step times in nanoseconds, exact below 2 * SUB_BUCKETS and from there 
+ * on every power of two split into SUB_BUCKETS buckets
+ */
+static long histogram[N_BUCKETS];
+static long max_step;
+static long over_budget;
 
 static long get_time(void) {
     struct timespec t;
@@ -17,15 +31,129 @@ static long get_time(void) {
     return t.tv_sec * 1000000000 + t.tv_nsec;
 }
 
-int main(int argc, char **argv) {
-    init_sim(argc, argv);
-    long t0 = get_time();
-    for (int t = 0; t < N_STEPS; t++) {
+static int bucket(long ns) {
+    if (ns < 2 * SUB_BUCKETS) {
+        return ns;
+    }
+    int e = 63 - __builtin_clzl(ns);
+    return (e - 3) * SUB_BUCKETS + (ns >> (e - 4) & (SUB_BUCKETS - 1));
+}
+
+/* the largest time that falls in bucket b */
+static long bucket_end(int b) {
+    if (b < 2 * SUB_BUCKETS) {
+        return b;
+    }
+    int e = b / SUB_BUCKETS + 3;
+    long start = (long) (SUB_BUCKETS + b % SUB_BUCKETS) << (e - 4);
+    return start + (1l << (e - 4)) - 1;
+}
+
+static void record_step(long ns, long budget) {
+    histogram[bucket(ns)]++;
+    max_step = ns > max_step ? ns : max_step;
+    over_budget += ns > budget;
+}
+
+/* the step time at or below which a share q of the steps took */
+static long percentile(double q, long n) {
+    long rank = ceil(q * n);
+    long seen = 0;
+    for (int b = 0; b < N_BUCKETS; b++) {
+        seen += histogram[b];
+        if (seen >= rank) {
+            long end = bucket_end(b);
+            return end < max_step ? end : max_step;
+        }
+    }
+    return max_step;
+}
+
+static void print_latency(long n, long budget) {
+    if (!n) {
+        return;
+    }
+    printf("step us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n", 
+           percentile(0.5, n) * 1e-3, percentile(0.9, n) * 1e-3, 
+           percentile(0.99, n) * 1e-3, percentile(0.999, n) * 1e-3, 
+           max_step * 1e-3);
+    printf("over %.1f us budget: %ld of %ld steps\n", budget * 1e-3, 
+           over_budget, n);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double p = *(const double *) a;
+    double q = *(const double *) b;
+    return (p > q) - (p < q);
+}
+
+/* median, slowest and sample standard deviation of the steps per second */
+static void print_rates(double *rates, int n) {
+    double mean = 0.0;
+    for (int r = 0; r < n; r++) {
+        mean += rates[r] / n;
+    }
+    double var = 0.0;
+    for (int r = 0; r < n; r++) {
+        var += (rates[r] - mean) * (rates[r] - mean);
+    }
+    double stddev = n > 1 ? sqrt(var / (n - 1)) : 0.0;
+    qsort(rates, n, sizeof(*rates), compare_double);
+    double median = n % 2 ? rates[n / 2] : 
+                    (rates[n / 2 - 1] + rates[n / 2]) / 2.0;
+    printf("steps/s: median %.1f min %.1f stddev %.1f runs %d\n", 
+           median, rates[0], stddev, n);
+}
+
+/* 
+ * sim.warmup untimed steps, then sim.runs timed runs of sim.n_steps steps 
+ * that carry on from each other, each timed step has the real time budget
+ * of 1 / sim.sps seconds
+ */
+static void bench_backend(void) {
+    memset(histogram, 0, sizeof(histogram));
+    max_step = 0;
+    over_budget = 0;
+    for (int t = 0; t < sim.warmup; t++) {
         step_sim();
     }
-    long t1 = get_time();
-    long dt = (t1 - t0) / 1000000; 
-    printf("cpu: %ld ms\n", dt); 
+    double *rates = xmalloc(sim.runs * sizeof(*rates));
+    long budget = 1000000000 / sim.sps;
+    long dt = 0;
+    for (int r = 0; r < sim.runs; r++) {
+        long t0 = get_time();
+        long ts = t0;
+        for (int t = 0; t < sim.n_steps; t++) {
+            step_sim();
+            long te = get_time();
+            record_step(te - ts, budget);
+            ts = te;
+        }
+        long t1 = ts;
+        dt += t1 - t0;
+        rates[r] = t1 > t0 ? sim.n_steps * 1e9 / (t1 - t0) : 0.0;
+    }
+    printf("cpu: %ld ms\n", dt / 1000000); 
+    print_rates(rates, sim.runs);
+    print_latency((long) sim.runs * sim.n_steps, budget);
     print_profile();
+    free(rates);
+}
+
+/* 
+ * every backend of -b in turn, each starting from the same balls, with 
+ * the workers it splits a step between
+ */
+int main(int argc, char **argv) {
+    init_sim(argc, argv);
+    for (int k = 0; k < sim.n_backends; k++) {
+        if (k) {
+            use_backend(k);
+            reset_sim();
+        }
+        printf("backend: %s\n", sim.backend->name);
+        printf("workers: %d grid: %d\n", sim.n_parts, sim.grid_len);
+        bench_backend();
+    }
     return 0;
 }
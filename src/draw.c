@@ -17,10 +17,10 @@ static GLuint vao;
 static GLuint ssbo[2];
 static GLuint tex;
 static GLuint prog;
-static uint32_t colors[N_BALLS];
+static uint32_t *colors;
 
-static vec4s gl_positions[N_BALLS];
-static uint32_t gl_colors[N_BALLS];
+static vec4s *gl_positions;
+static uint32_t *gl_colors;
 
 static GLuint gen_shader(GLenum type, const char *path) {
     GLuint shader = glCreateShader(type);
@@ -140,21 +140,26 @@ static void init_tex(void) {
 }
 
 static void init_bufs(void) {
+    gl_positions = xmalloc(sim.n_balls * sizeof(*gl_positions));
+    gl_colors = xmalloc(sim.n_balls * sizeof(*gl_colors));
     glGenVertexArrays(1, &vao);
     glGenBuffers(2, ssbo);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo[0]);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(gl_positions), 
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 
+                 sim.n_balls * sizeof(*gl_positions), 
                  NULL, GL_DYNAMIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, ssbo[0]);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo[1]);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(gl_colors), 
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 
+                 sim.n_balls * sizeof(*gl_colors), 
                  NULL, GL_DYNAMIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, ssbo[1]);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
 static void init_colors(void) {
-    for (int i = 0; i < N_BALLS; i++) {
+    colors = xmalloc(sim.n_balls * sizeof(*colors));
+    for (int i = 0; i < sim.n_balls; i++) {
         double h = drand48() * 6.0;
         double s = drand48() * 0.5 + 0.5;
         double v = drand48() * 0.5 + 0.5;
@@ -202,36 +207,36 @@ void draw(void) {
     mat4s proj = glms_perspective_default(aspect);
 
     /* transform positions into view space*/
-    float *zs = malloc(N_BALLS * sizeof(float));
-    for (int i = 0; i < N_BALLS; i++) {
-        vec4s v = glms_vec4(glms_vec3(sim.x[i]), 1.0f);
+    float *zs = malloc(sim.n_balls * sizeof(float));
+    for (int i = 0; i < sim.n_balls; i++) {
+        vec4s v = glms_vec4(get_vec(&sim.x, i), 1.0f);
         v = mat4_mulv(view, v);
         zs[i] = v.z;
     }
 
     /* indirect sort view space positions back to front*/
-    int *balls_idx = malloc(N_BALLS * sizeof(int));
-    for (int i = 0; i < N_BALLS; i++) {
+    int *balls_idx = malloc(sim.n_balls * sizeof(int));
+    for (int i = 0; i < sim.n_balls; i++) {
         balls_idx[i] = i;
     }
-    qsort_r(balls_idx, N_BALLS, sizeof(int), pos_cmp, zs);
+    qsort_r(balls_idx, sim.n_balls, sizeof(int), pos_cmp, zs);
     free(zs);
     zs = NULL;
 
     /* create ball ssbo data*/
-    for (int i = 0; i < N_BALLS; i++) {
+    for (int i = 0; i < sim.n_balls; i++) {
         int j = balls_idx[i];
-        gl_positions[i] = glms_vec4(glms_vec3(sim.x[j]), 1.0f);
-        gl_colors[i] = colors[j];
+        gl_positions[i] = glms_vec4(get_vec(&sim.x, j), sim.r[j]);
+        gl_colors[i] = colors[sim.ids[j]];
     }
     free(balls_idx);
     balls_idx = NULL;
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo[0]);
     glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, 
-                    sizeof(gl_positions), &gl_positions);
+                    sim.n_balls * sizeof(*gl_positions), gl_positions);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo[1]);
     glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, 
-                    sizeof(gl_colors), &gl_colors);
+                    sim.n_balls * sizeof(*gl_colors), gl_colors);
     
     /* render data */
     glEnable(GL_BLEND);
@@ -244,5 +249,5 @@ void draw(void) {
     glBindVertexArray(vao);
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, tex);
-    glDrawArrays(GL_TRIANGLES, 0, N_BALLS * 6);
+    glDrawArrays(GL_TRIANGLES, 0, sim.n_balls * 6);
 }
@@ -18,3 +18,20 @@ void *xmalloc(size_t size) {
     }
     return ptr;
 }
+
+void *xrealloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+        die("out of memory\n");
+    }
+    return ptr;
+}
+
+void *xaligned_alloc(size_t align, size_t size) {
+    size = (size + align - 1) / align * align;
+    void *ptr = aligned_alloc(align, size);
+    if (!ptr) {
+        die("out of memory\n");
+    }
+    return ptr;
+}
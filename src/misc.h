@@ -4,3 +4,5 @@
 
 void die(const char *fmt, ...);
 void *xmalloc(size_t size);
+void *xrealloc(void *ptr, size_t size);
+void *xaligned_alloc(size_t align, size_t size);
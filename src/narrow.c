@@ -0,0 +1,109 @@
+#include "narrow.h"
+#include "sim.h"
+#include "misc.h"
+#include <immintrin.h>
+#include <string.h>
+
+void(*resolve_candidates)(int, const ball_idx *, int);
+
+static void resolve_candidates_scalar(int i, const ball_idx *js, int n) {
+    for (int k = 0; k < n; k++) {
+        resolve_ball_ball_collision(i, js[k]);
+    }
+}
+
+/* 
+ * the vector paths only reject misses, the first overlapping lane is 
+ * resolved by the scalar code and the batch starts over after it, as 
+ * ball i has moved, so corrections stay Gauss-Seidel
+ */
+__attribute__((target("avx2")))
+static void resolve_candidates_avx2(int i, const ball_idx *js, int n) {
+    __m256 zero = _mm256_setzero_ps();
+    __m256 ri = _mm256_set1_ps(sim.r[i]);
+    int k = 0;
+    while (k + 8 <= n) {
+#if IDX_BITS == 16
+        __m128i j16 = _mm_loadu_si128((const __m128i *) (js + k));
+        __m256i j = _mm256_cvtepi16_epi32(j16);
+#else
+        __m256i j = _mm256_loadu_si256((const __m256i *) (js + k));
+#endif
+        __m256 xj = _mm256_i32gather_ps(sim.x.x, j, 4);
+        __m256 yj = _mm256_i32gather_ps(sim.x.y, j, 4);
+        __m256 zj = _mm256_i32gather_ps(sim.x.z, j, 4);
+        __m256 rj = _mm256_i32gather_ps(sim.r, j, 4);
+        __m256 nx = _mm256_sub_ps(_mm256_set1_ps(sim.x.x[i]), xj);
+        __m256 ny = _mm256_sub_ps(_mm256_set1_ps(sim.x.y[i]), yj);
+        __m256 nz = _mm256_sub_ps(_mm256_set1_ps(sim.x.z[i]), zj);
+        __m256 contact = _mm256_add_ps(ri, rj);
+        __m256 d2_max = _mm256_mul_ps(contact, contact);
+        __m256 d2 = _mm256_mul_ps(nx, nx);
+        d2 = _mm256_add_ps(d2, _mm256_mul_ps(ny, ny));
+        d2 = _mm256_add_ps(d2, _mm256_mul_ps(nz, nz));
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(d2, zero, _CMP_GT_OQ), 
+                                   _mm256_cmp_ps(d2, d2_max, _CMP_LT_OQ));
+        unsigned mask = _mm256_movemask_ps(hit);
+        if (!mask) {
+            k += 8;
+            continue;
+        }
+        k += __builtin_ctz(mask);
+        resolve_ball_ball_collision(i, js[k++]);
+    }
+    resolve_candidates_scalar(i, js + k, n - k);
+}
+
+__attribute__((target("avx512f")))
+static void resolve_candidates_avx512(int i, const ball_idx *js, int n) {
+    __m512 zero = _mm512_setzero_ps();
+    __m512 ri = _mm512_set1_ps(sim.r[i]);
+    int k = 0;
+    while (k + 16 <= n) {
+#if IDX_BITS == 16
+        __m256i j16 = _mm256_loadu_si256((const __m256i *) (js + k));
+        __m512i j = _mm512_cvtepi16_epi32(j16);
+#else
+        __m512i j = _mm512_loadu_si512(js + k);
+#endif
+        __m512 xj = _mm512_i32gather_ps(j, sim.x.x, 4);
+        __m512 yj = _mm512_i32gather_ps(j, sim.x.y, 4);
+        __m512 zj = _mm512_i32gather_ps(j, sim.x.z, 4);
+        __m512 rj = _mm512_i32gather_ps(j, sim.r, 4);
+        __m512 nx = _mm512_sub_ps(_mm512_set1_ps(sim.x.x[i]), xj);
+        __m512 ny = _mm512_sub_ps(_mm512_set1_ps(sim.x.y[i]), yj);
+        __m512 nz = _mm512_sub_ps(_mm512_set1_ps(sim.x.z[i]), zj);
+        __m512 contact = _mm512_add_ps(ri, rj);
+        __m512 d2_max = _mm512_mul_ps(contact, contact);
+        __m512 d2 = _mm512_mul_ps(nx, nx);
+        d2 = _mm512_add_ps(d2, _mm512_mul_ps(ny, ny));
+        d2 = _mm512_add_ps(d2, _mm512_mul_ps(nz, nz));
+        __mmask16 hit = _mm512_cmp_ps_mask(d2, zero, _CMP_GT_OQ);
+        hit = _mm512_mask_cmp_ps_mask(hit, d2, d2_max, _CMP_LT_OQ);
+        if (!hit) {
+            k += 16;
+            continue;
+        }
+        k += __builtin_ctz(hit);
+        resolve_ball_ball_collision(i, js[k++]);
+    }
+    resolve_candidates_avx2(i, js + k, n - k);
+}
+
+void init_narrow(const char *isa) {
+    __builtin_cpu_init();
+    int avx2 = __builtin_cpu_supports("avx2");
+    int avx512 = avx2 && __builtin_cpu_supports("avx512f");
+    if (!isa) {
+        isa = avx512 ? "avx512" : avx2 ? "avx2" : "scalar";
+    }
+    if (!strcmp(isa, "scalar")) {
+        resolve_candidates = resolve_candidates_scalar;
+    } else if (!strcmp(isa, "avx2") && avx2) {
+        resolve_candidates = resolve_candidates_avx2;
+    } else if (!strcmp(isa, "avx512") && avx512) {
+        resolve_candidates = resolve_candidates_avx512;
+    } else {
+        die("narrow phase %s not supported\n", isa);
+    }
+}
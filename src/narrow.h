@@ -0,0 +1,54 @@
+#pragma once
+
+#include "sim.h"
+#include <math.h>
+
+#define NARROW_MIN 8
+
+extern void(*resolve_candidates)(int, const ball_idx *, int);
+
+void init_narrow(const char *isa);
+
+static inline void resolve_ball_ball_collision(int i, int j) {
+    float nx = sim.x.x[i] - sim.x.x[j];
+    float ny = sim.x.y[i] - sim.x.y[j];
+    float nz = sim.x.z[i] - sim.x.z[j];
+    float d2 = nx * nx + ny * ny + nz * nz;
+    float contact = sim.r[i] + sim.r[j];
+    if (d2 > 0.0f && d2 < contact * contact) {
+        /* the lighter ball takes the larger share of the correction */
+        float d = sqrtf(d2);
+        float corr = (contact - d) / (sim.w[i] + sim.w[j]);
+        float dx = nx / d * corr;
+        float dy = ny / d * corr;
+        float dz = nz / d * corr;
+        sim.x.x[i] += dx * sim.w[i];
+        sim.x.y[i] += dy * sim.w[i];
+        sim.x.z[i] += dz * sim.w[i];
+        sim.x.x[j] -= dx * sim.w[j];
+        sim.x.y[j] -= dy * sim.w[j];
+        sim.x.z[j] -= dz * sim.w[j];
+    }
+}
+
+/* workers test pairs concurrently */
+static inline void count_tests(int n) {
+#ifdef USE_PROFILE
+    __atomic_fetch_add(&sim.n_tests, n, __ATOMIC_RELAXED);
+#else
+    (void) n;
+#endif
+}
+
+/* short candidate lists are not worth a vector pass */
+static inline void resolve_ball_candidates(int i, const ball_idx *js, 
+                                           int n) {
+    count_tests(n);
+    if (n < NARROW_MIN) {
+        for (int k = 0; k < n; k++) {
+            resolve_ball_ball_collision(i, js[k]);
+        }
+    } else {
+        resolve_candidates(i, js, n);
+    }
+}
@@ -0,0 +1,516 @@
+#include "profile.h"
+#include "misc.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#define CACHE_LINE 64
+#define N_EVENTS 5
+#define TRACE_EVENTS (1 << 18)
+#define TRACE_STEP N_PHASES
+#define TRACE_DISPATCH (N_PHASES + 1)
+#define CACHE_EVENT(cache) (PERF_COUNT_HW_CACHE_##cache | \
+    PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+/* 
+ * the main thread times the sections of a step, within a section every
+ * parallel_work is a span in which each worker works for a while and
+ * waits for the others the rest of it, outside of the spans the section
+ * runs on the main thread alone, an event is a section, step or dispatch
+ * of the main thread or with work set what a worker did of a phase, name
+ * is a phase or TRACE_STEP or TRACE_DISPATCH
+ */
+struct trace_event {
+    uint64_t start;
+    uint64_t end;
+    int name;
+    short pass;
+    short work;
+};
+
+struct worker_slot {
+    uint64_t start;
+    uint64_t work;
+    struct trace_event *trace;
+    uint64_t n_traced;
+    int fd;
+    uint64_t enabled;
+    uint64_t running;
+    uint64_t count_start[N_EVENTS];
+    uint64_t count[N_EVENTS];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct event {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+struct pass_stats {
+    uint64_t span;
+    uint64_t max_work;
+    uint64_t work;
+};
+
+static const char *const phase_names[N_PHASES] = {
+    "reorder", "integrate", "grid", "collide", "velocity"
+};
+
+static const char *const trace_names[N_PHASES + 2] = {
+    "reorder", "integrate", "grid", "collide", "velocity", "step", "dispatch"
+};
+
+static const struct event events[N_EVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"llc-misses", PERF_TYPE_HW_CACHE, CACHE_EVENT(LL)},
+    {"dtlb-misses", PERF_TYPE_HW_CACHE, CACHE_EVENT(DTLB)},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static int n_slots;
+static int n_pass_stats;
+static struct worker_slot *slots;
+static uint64_t *phase_work;
+static uint64_t *phase_wait;
+static uint64_t phase_wall[N_PHASES];
+static uint64_t phase_span[N_PHASES];
+static struct pass_stats *passes;
+static int phase = -1;
+static int pass = -1;
+static uint64_t section_start;
+static uint64_t span_start;
+static uint64_t step_start;
+static const char *trace_path;
+static const char *counters_path;
+static int counted[N_EVENTS];
+static int n_counted;
+static uint64_t phase_counts[N_PHASES][N_EVENTS];
+static uint64_t section_counts[N_EVENTS];
+static uint64_t span_counts[N_EVENTS];
+static uint64_t tsc0;
+static struct timespec clock0;
+
+static int open_event(const struct event *e, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = e->type;
+    attr.config = e->config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/* 
+ * the events of the calling thread in one group so they count over the
+ * same time, the first thread to open them learns which events exist
+ */
+static int open_counters(void) {
+    int group = -1;
+    for (int e = 0; e < N_EVENTS; e++) {
+        if (n_counted && !counted[e]) {
+            continue;
+        }
+        int fd = open_event(&events[e], group);
+        if (fd < 0 && n_counted) {
+            die("perf_event_open %s: %s\n", events[e].name, strerror(errno));
+        }
+        if (fd < 0) {
+            fprintf(stderr, "perf_event_open %s: %s\n", events[e].name, 
+                    strerror(errno));
+            continue;
+        }
+        group = group < 0 ? fd : group;
+        counted[e] = 1;
+    }
+    if (group < 0) {
+        die("no hardware counters to count\n");
+    }
+    if (!n_counted) {
+        for (int e = 0; e < N_EVENTS; e++) {
+            n_counted += counted[e];
+        }
+    }
+    return group;
+}
+
+/* counts of the group of fd in event order, 0 for the events not counted */
+static void read_counters(struct worker_slot *slot, uint64_t *counts) {
+    uint64_t buf[3 + N_EVENTS];
+    if (read(slot->fd, buf, sizeof(buf)) < 0) {
+        die("read counters: %s\n", strerror(errno));
+    }
+    slot->enabled = buf[1];
+    slot->running = buf[2];
+    for (int e = 0, k = 3; e < N_EVENTS; e++) {
+        counts[e] = counted[e] ? buf[k++] : 0;
+    }
+}
+
+/* 
+ * each thread writes only its own ring so none of them wait to trace, 
+ * the ring keeps the last TRACE_EVENTS events of the thread
+ */
+static void trace(struct worker_slot *slot, uint64_t start, uint64_t end, 
+                  int name, int work) {
+    struct trace_event *e = &slot->trace[slot->n_traced % TRACE_EVENTS];
+    e->start = start;
+    e->end = end;
+    e->name = name;
+    e->pass = pass;
+    e->work = work;
+    __atomic_store_n(&slot->n_traced, slot->n_traced + 1, __ATOMIC_RELEASE);
+}
+
+static double ms_per_tick(void);
+
+/* 
+ * the rings as complete events of the Chrome trace event format, one 
+ * thread per worker with worker 0 the main thread
+ */
+static void write_trace(void) {
+    double us = ms_per_tick() * 1e3;
+    FILE *f = fopen(trace_path, "w");
+    if (!f) {
+        die("fopen %s: %s\n", trace_path, strerror(errno));
+    }
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    const char *sep = "";
+    for (int w = 0; w < n_slots; w++) {
+        fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+                "\"pid\": 1, \"tid\": %d, \"args\": {\"name\": "
+                "\"worker %d\"}}", sep, w, w);
+        sep = ",";
+        uint64_t n = __atomic_load_n(&slots[w].n_traced, __ATOMIC_ACQUIRE);
+        uint64_t i = n > TRACE_EVENTS ? n - TRACE_EVENTS : 0;
+        for (; i < n; i++) {
+            const struct trace_event *e = &slots[w].trace[i % TRACE_EVENTS];
+            fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", "
+                    "\"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                    "\"pid\": 1, \"tid\": %d", trace_names[e->name], 
+                    e->work ? "work" : "main", 
+                    (e->start - tsc0) * us, (e->end - e->start) * us, w);
+            if (e->pass >= 0) {
+                fprintf(f, ", \"args\": {\"pass\": %d}", e->pass);
+            }
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+void init_profile(int n_workers, int n_passes, const char *counters, 
+                  const char *trace_file) {
+    n_slots = n_workers;
+    n_pass_stats = n_passes;
+    slots = xaligned_alloc(CACHE_LINE, n_slots * sizeof(*slots));
+    memset(slots, 0, n_slots * sizeof(*slots));
+    for (int w = 0; w < n_slots; w++) {
+        slots[w].fd = -1;
+    }
+    counters_path = counters;
+    trace_path = trace_file;
+    if (trace_path) {
+        for (int w = 0; w < n_slots; w++) {
+            slots[w].trace = xmalloc(TRACE_EVENTS * sizeof(*slots[w].trace));
+        }
+        atexit(write_trace);
+    }
+    if (counters_path) {
+        slots[0].fd = open_counters();
+        read_counters(&slots[0], section_counts);
+    }
+    phase_work = xmalloc(N_PHASES * n_slots * sizeof(*phase_work));
+    phase_wait = xmalloc(N_PHASES * n_slots * sizeof(*phase_wait));
+    memset(phase_work, 0, N_PHASES * n_slots * sizeof(*phase_work));
+    memset(phase_wait, 0, N_PHASES * n_slots * sizeof(*phase_wait));
+    passes = xmalloc((n_passes + 1) * sizeof(*passes));
+    memset(passes, 0, (n_passes + 1) * sizeof(*passes));
+    clock_gettime(CLOCK_MONOTONIC, &clock0);
+    tsc0 = read_tsc();
+}
+
+/* forget the times and counts so far, traces are kept */
+void reset_profile(void) {
+    memset(phase_work, 0, N_PHASES * n_slots * sizeof(*phase_work));
+    memset(phase_wait, 0, N_PHASES * n_slots * sizeof(*phase_wait));
+    memset(phase_wall, 0, sizeof(phase_wall));
+    memset(phase_span, 0, sizeof(phase_span));
+    memset(phase_counts, 0, sizeof(phase_counts));
+    memset(passes, 0, (n_pass_stats + 1) * sizeof(*passes));
+}
+
+/* end the current section and start the next, -1 ends it for good */
+void profile_section(int next) {
+    uint64_t t = read_tsc();
+    if (phase >= 0) {
+        phase_wall[phase] += t - section_start;
+    }
+    if (trace_path) {
+        if (phase >= 0) {
+            trace(&slots[0], section_start, t, phase, 0);
+        }
+        if (phase < 0 && next >= 0) {
+            step_start = t;
+        } else if (phase >= 0 && next < 0) {
+            trace(&slots[0], step_start, t, TRACE_STEP, 0);
+        }
+    }
+    if (counters_path) {
+        uint64_t counts[N_EVENTS];
+        read_counters(&slots[0], counts);
+        for (int e = 0; e < N_EVENTS; e++) {
+            if (phase >= 0) {
+                phase_counts[phase][e] += counts[e] - section_counts[e];
+            }
+            section_counts[e] = counts[e];
+        }
+    }
+    phase = next;
+    pass = -1;
+    section_start = t;
+}
+
+void profile_pass(int p) {
+    pass = p;
+}
+
+/* 
+ * each worker records its own slot, so workers never share a line, and 
+ * opens its counters the first time it works
+ */
+void profile_work_begin(int worker_idx) {
+    struct worker_slot *slot = &slots[worker_idx];
+    if (counters_path) {
+        if (slot->fd < 0) {
+            slot->fd = open_counters();
+        }
+        read_counters(slot, slot->count_start);
+    }
+    slot->start = read_tsc();
+}
+
+void profile_work_end(int worker_idx) {
+    struct worker_slot *slot = &slots[worker_idx];
+    uint64_t t = read_tsc();
+    slot->work = t - slot->start;
+    if (trace_path && phase >= 0) {
+        trace(slot, slot->start, t, phase, 1);
+    }
+    if (counters_path) {
+        uint64_t counts[N_EVENTS];
+        read_counters(slot, counts);
+        for (int e = 0; e < N_EVENTS; e++) {
+            slot->count[e] = counts[e] - slot->count_start[e];
+        }
+    }
+}
+
+void profile_span_begin(void) {
+    if (counters_path) {
+        read_counters(&slots[0], span_counts);
+    }
+    span_start = read_tsc();
+}
+
+/* 
+ * called on the main thread once every worker of a span is done, the 
+ * counts of the span are replaced by what each worker counted while it 
+ * worked so spinning at the barriers is left out
+ */
+void profile_span_end(void) {
+    uint64_t t = read_tsc();
+    uint64_t ticks = t - span_start;
+    if (phase < 0) {
+        return;
+    }
+    if (trace_path) {
+        trace(&slots[0], span_start, t, TRACE_DISPATCH, 0);
+    }
+    if (counters_path) {
+        uint64_t counts[N_EVENTS];
+        read_counters(&slots[0], counts);
+        for (int e = 0; e < N_EVENTS; e++) {
+            phase_counts[phase][e] -= counts[e] - span_counts[e];
+            for (int w = 0; w < n_slots; w++) {
+                phase_counts[phase][e] += slots[w].count[e];
+            }
+        }
+    }
+    uint64_t max_work = 0;
+    uint64_t work = 0;
+    for (int w = 0; w < n_slots; w++) {
+        uint64_t t = slots[w].work;
+        phase_work[phase * n_slots + w] += t;
+        phase_wait[phase * n_slots + w] += ticks > t ? ticks - t : 0;
+        max_work = t > max_work ? t : max_work;
+        work += t;
+    }
+    phase_span[phase] += ticks;
+    if (phase == PHASE_COLLIDE && pass >= 0 && pass < n_pass_stats) {
+        passes[pass].span += ticks;
+        passes[pass].max_work += max_work;
+        passes[pass].work += work;
+    }
+}
+
+static double ms_per_tick(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    uint64_t ticks = read_tsc() - tsc0;
+    double ms = (t.tv_sec - clock0.tv_sec) * 1e3 +
+                (t.tv_nsec - clock0.tv_nsec) * 1e-6;
+    return ticks ? ms / ticks : 0.0;
+}
+
+/* the least share of the time any thread had its counters scheduled */
+static double counter_coverage(void) {
+    double coverage = 1.0;
+    for (int w = 0; w < n_slots; w++) {
+        if (slots[w].fd >= 0 && slots[w].enabled) {
+            double c = (double) slots[w].running / slots[w].enabled;
+            coverage = c < coverage ? c : coverage;
+        }
+    }
+    return coverage;
+}
+
+/* 
+ * the counts of each phase as a table and as JSON to counters_path, or 
+ * to stdout for -
+ */
+static void print_counters(double k) {
+    printf("%-10s", "phase");
+    for (int e = 0; e < N_EVENTS; e++) {
+        printf(" %14s", events[e].name);
+    }
+    printf(" %6s\n", "ipc");
+    for (int p = 0; p < N_PHASES; p++) {
+        if (!phase_wall[p]) {
+            continue;
+        }
+        printf("%-10s", phase_names[p]);
+        for (int e = 0; e < N_EVENTS; e++) {
+            if (counted[e]) {
+                printf(" %14" PRIu64, phase_counts[p][e]);
+            } else {
+                printf(" %14s", "-");
+            }
+        }
+        uint64_t cycles = phase_counts[p][0];
+        if (counted[0] && counted[1] && cycles) {
+            printf(" %6.2f\n", (double) phase_counts[p][1] / cycles);
+        } else {
+            printf(" %6s\n", "-");
+        }
+    }
+    double coverage = counter_coverage();
+    if (coverage < 1.0) {
+        printf("counters were multiplexed, counting %.0f%% of the time\n", 
+               100.0 * coverage);
+    }
+    FILE *f = strcmp(counters_path, "-") ? fopen(counters_path, "w") : stdout;
+    if (!f) {
+        die("fopen %s: %s\n", counters_path, strerror(errno));
+    }
+    fprintf(f, "{\"coverage\": %.4f, \"phases\": [", coverage);
+    const char *sep = "";
+    for (int p = 0; p < N_PHASES; p++) {
+        if (!phase_wall[p]) {
+            continue;
+        }
+        fprintf(f, "%s\n  {\"phase\": \"%s\", \"wall_ms\": %.3f", sep, 
+                phase_names[p], phase_wall[p] * k);
+        for (int e = 0; e < N_EVENTS; e++) {
+            fprintf(f, ", \"%s\": ", events[e].name);
+            if (counted[e]) {
+                fprintf(f, "%" PRIu64, phase_counts[p][e]);
+            } else {
+                fprintf(f, "null");
+            }
+        }
+        fprintf(f, "}");
+        sep = ",";
+    }
+    fprintf(f, "\n]}\n");
+    if (f != stdout) {
+        fclose(f);
+    }
+}
+
+/* 
+ * wall time of each section, with workers also the time outside of spans,
+ * the least, average and most any worker worked and the average wait at
+ * the barriers, per collision pass the critical path and imbalance
+ */
+static void print_times(double k) {
+    int spans = 0;
+    for (int p = 0; p < N_PHASES; p++) {
+        spans |= phase_span[p] > 0;
+    }
+    if (!spans) {
+        printf("%-10s %9s\n", "phase", "wall ms");
+        for (int p = 0; p < N_PHASES; p++) {
+            if (phase_wall[p]) {
+                printf("%-10s %9.1f\n", phase_names[p], phase_wall[p] * k);
+            }
+        }
+        return;
+    }
+    printf("%-10s %9s %9s %9s %9s %9s %9s\n", "phase", "wall ms",
+           "serial ms", "work min", "work avg", "work max", "wait avg");
+    for (int p = 0; p < N_PHASES; p++) {
+        if (!phase_wall[p]) {
+            continue;
+        }
+        uint64_t min = UINT64_MAX;
+        uint64_t max = 0;
+        uint64_t sum = 0;
+        uint64_t wait = 0;
+        for (int w = 0; w < n_slots; w++) {
+            uint64_t t = phase_work[p * n_slots + w];
+            min = t < min ? t : min;
+            max = t > max ? t : max;
+            sum += t;
+            wait += phase_wait[p * n_slots + w];
+        }
+        uint64_t serial = phase_wall[p] > phase_span[p] ?
+                          phase_wall[p] - phase_span[p] : 0;
+        printf("%-10s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+               phase_names[p], phase_wall[p] * k, serial * k, min * k,
+               (double) sum / n_slots * k, max * k,
+               (double) wait / n_slots * k);
+    }
+    int header = 0;
+    for (int p = 0; p < n_pass_stats; p++) {
+        if (!passes[p].span) {
+            continue;
+        }
+        if (!header) {
+            printf("%-10s %9s %9s %9s\n", "pass", "span ms", "max ms",
+                   "idle %");
+            header = 1;
+        }
+        double idle = 100.0 * (1.0 - (double) passes[p].work /
+                               ((double) passes[p].span * n_slots));
+        printf("%-10d %9.1f %9.1f %9.1f\n", p, passes[p].span * k,
+               passes[p].max_work * k, idle);
+    }
+}
+
+void print_phases(void) {
+    double k = ms_per_tick();
+    print_times(k);
+    if (counters_path) {
+        print_counters(k);
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+enum phase {
+    PHASE_REORDER,
+    PHASE_INTEGRATE,
+    PHASE_GRID,
+    PHASE_COLLIDE,
+    PHASE_VELOCITY,
+    N_PHASES
+};
+
+/* 
+ * ticks of the time stamp counter, or nanoseconds where there is none,
+ * print_phases converts them to time against the monotonic clock
+ */
+static inline uint64_t read_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+#endif
+}
+
+void init_profile(int n_workers, int n_passes, const char *counters, 
+                  const char *trace_file);
+void reset_profile(void);
+void profile_section(int phase);
+void profile_pass(int pass);
+void profile_work_begin(int worker_idx);
+void profile_work_end(int worker_idx);
+void profile_span_begin(void);
+void profile_span_end(void);
+void print_phases(void);
@@ -5,22 +5,26 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-void init_positions(void);
-void init_velocities(void);
 void init_grid(void);
 void resolve_collisions(void);
 
 static cl_context context;
 static cl_device_id device;
-static cl_program program;
+static cl_program programs[27];
 static cl_kernel symplectic_euler_kernel;
-static cl_kernel resolve_pair_collisions_kernel;
-static cl_mem sim_mem;
+static cl_kernel resolve_pair_collisions_kernels[27];
+static cl_mem x_mem;
+static cl_mem v_mem;
+static cl_mem cell_start_mem;
+static cl_mem sorted_mem;
 static cl_command_queue cmdq;
+#ifdef USE_PROFILE
 static cl_ulong elapsed;
+#endif
 
 static void cl_notify(const char *err, const void *priv, size_t cb, void *user) {
     fprintf(stderr, "cl: %s\n", err);
@@ -51,27 +55,44 @@ static char *read_text_file(const char *path) {
     return buf;
 } 
 
-static cl_kernel create_kernel(const char *name) {
+static void set_kernel_arg(cl_kernel kernel, int idx, size_t size, 
+                           const void *arg) {
+    cl_int err = clSetKernelArg(kernel, idx, size, arg);
+    if (err) {
+        die("clSetKernelArg(%d)\n", err);
+    }
+}
+
+static cl_kernel create_kernel(cl_program program, const char *name, 
+                               int n_mems, cl_mem *mems) {
     cl_int err;
     cl_kernel kernel = clCreateKernel(program, name, &err);
     if (err) {
         die("clCreateKernel(%d)\n", err);
     }
-    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &sim_mem);
-    if (err) {
-        die("clSetKernelArg(%d)\n", err);
+    for (int i = 0; i < n_mems; i++) {
+        set_kernel_arg(kernel, i, sizeof(cl_mem), &mems[i]);
     }
     return kernel;
 }
 
-static void copy_balls_to_gpu(void) {
+static cl_mem create_buffer(size_t size) {
+    cl_int err;
+    cl_mem mem = clCreateBuffer(context, 0, size, NULL, &err);
+    if (err) {
+        die("clCreateBuffer(%d)\n", err);
+    }
+    return mem;
+}
+
+static void write_buffer(cl_mem mem, size_t size, const void *src) {
     cl_int err = clEnqueueWriteBuffer(
         cmdq, /* command queue */
-        sim_mem, /* destination */
+        mem, /* destination */
         CL_TRUE, /* blocking */
         0, /* offset of destination */
-        sizeof(sim.x) + sizeof(sim.v), /* size of copy */
-        &sim, /* source */
+        size, /* size of copy */
+        src, /* source */
         0, /* empty wait list */
         NULL, 
         NULL
@@ -81,14 +102,19 @@ static void copy_balls_to_gpu(void) {
     }
 }
 
-static void copy_balls_to_cpu(void) {
+static void copy_balls_to_gpu(void) {
+    write_buffer(x_mem, 3 * sim.stride * sizeof(float), sim.x.x);
+    write_buffer(v_mem, 3 * sim.stride * sizeof(float), sim.v.x);
+}
+
+static void read_buffer(cl_mem mem, size_t size, void *dst) {
     cl_int err = clEnqueueReadBuffer(
         cmdq, 
-        sim_mem, 
+        mem, 
         CL_TRUE, 
         0, 
-        sizeof(sim.x),
-        &sim, 
+        size,
+        dst, 
         0, 
         NULL, 
         NULL
@@ -98,25 +124,32 @@ static void copy_balls_to_cpu(void) {
     }
 }
 
+static void copy_balls_to_cpu(void) {
+    read_buffer(x_mem, 3 * sim.stride * sizeof(float), sim.x.x);
+}
 
-static void init_cl(void) {
+/* 
+ * every pass gets its own program with the stencil of the pass built in, 
+ * so the kernel walks the tiles with constant offsets and strides
+ */
+static cl_program build_program(const char *code, struct stencil s) {
     cl_int err;
-    err = clGetDeviceIDs(NULL, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
-    if (err) {
-        die("clGetDeviceIDs(%d)\n", err);
-    }
-    context = clCreateContext(NULL, 1, &device, cl_notify, NULL, &err);
-    if (err) {
-        die("clCreateContext(%d)\n", err);
-    }
-    const char *code = read_text_file("res/sim.cl");
-    program = clCreateProgramWithSource(context, 1, &code, NULL, &err);
+    cl_program program = clCreateProgramWithSource(context, 1, &code, NULL, 
+                                                   &err);
     if (err) {
         die("clCreateProgramWithSource(%d)\n", err);
     }
-    free((void *) code);
-    code = NULL;
-    err = clBuildProgram(program, 1, &device, "", NULL, NULL);
+    char opts[512];
+    snprintf(opts, sizeof(opts), 
+             "-D N_BALLS=%d -D GRID_LEN=%d -D RADIUS=%.9ef "
+             "-D DIAMETER=%.9ef -D SPS=%d -D BALL_IDX=%s -D STRIDE=%d "
+             "-D TX=%d -D TY=%d -D TZ=%d -D PX=%d -D PY=%d -D PZ=%d "
+             "-D NX=%d -D NY=%d -D NZ=%d -D IX=%d -D IY=%d -D IZ=%d", 
+             sim.n_balls, sim.grid_len, sim.radius, sim.diameter, sim.sps,
+             IDX_BITS == 16 ? "short" : "int", sim.stride, 
+             s.tx, s.ty, s.tz, s.px, s.py, s.pz, 
+             s.nx, s.ny, s.nz, s.ix, s.iy, s.iz);
+    err = clBuildProgram(program, 1, &device, opts, NULL, NULL);
     if (err == CL_BUILD_PROGRAM_FAILURE) {
         size_t size;
         clGetProgramBuildInfo(
@@ -143,12 +176,44 @@ static void init_cl(void) {
     if (err) {
         die("clBuildProgram(%d)\n", err);
     }
-    sim_mem = clCreateBuffer(context, 0, sizeof(sim), NULL, &err);
+    return program;
+}
+
+static void init_cl(void) {
+    cl_int err;
+    err = clGetDeviceIDs(NULL, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
     if (err) {
-        die("clCreateBuffer(%d)\n", err);
+        die("clGetDeviceIDs(%d)\n", err);
+    }
+    context = clCreateContext(NULL, 1, &device, cl_notify, NULL, &err);
+    if (err) {
+        die("clCreateContext(%d)\n", err);
+    }
+    const char *code = read_text_file("res/sim.cl");
+    for (int i = 0; i < 27; i++) {
+        programs[i] = build_program(code, pass_stencil(i));
+    }
+    free((void *) code);
+    code = NULL;
+    int n_cells = sim.grid_len * sim.grid_len * sim.grid_len;
+    x_mem = create_buffer(3 * sim.stride * sizeof(float));
+    v_mem = create_buffer(3 * sim.stride * sizeof(float));
+    cell_start_mem = create_buffer((n_cells + 1) * sizeof(*sim.cell_start));
+    sorted_mem = create_buffer(sim.n_balls * sizeof(*sim.sorted));
+    symplectic_euler_kernel = create_kernel(
+        programs[0], 
+        "symplectic_euler", 
+        2, 
+        (cl_mem[]) {x_mem, v_mem}
+    );
+    for (int i = 0; i < 27; i++) {
+        resolve_pair_collisions_kernels[i] = create_kernel(
+            programs[i], 
+            "resolve_pair_collisions", 
+            4, 
+            (cl_mem[]) {x_mem, v_mem, cell_start_mem, sorted_mem}
+        );
     }
-    symplectic_euler_kernel = create_kernel("symplectic_euler");
-    resolve_pair_collisions_kernel = create_kernel("resolve_pair_collisions");
     cmdq = clCreateCommandQueueWithProperties(
         context, 
         device, 
@@ -166,28 +231,33 @@ static void init_cl(void) {
     }
 }
 
-void init_sim(int argc, char **argv) {
-    init_positions();
-    init_velocities();
+static void init_cl_backend(void) {
+    if (sim.reorder || sim.morton_steps || sim.skin > 0.0f || 
+        sim.ratio > 1.0f || sim.n_levels > 1 || sim.hashed || 
+        sim.checkerboard || sim.jacobi || sim.counters || sim.trace) {
+        die("-R, -M, -K, -P, -L, -H, -C, -J, -E and -T are not supported "
+            "by the OpenCL backend\n");
+    }
     init_cl();
+    sim.n_parts = 1;
+}
+
+static void load_cl(void) {
+    sim.n_parts = 1;
     copy_balls_to_gpu();
 }
 
+/* the velocities only live on the GPU between steps */
+static void unload_cl(void) {
+    copy_balls_to_cpu();
+    read_buffer(v_mem, 3 * sim.stride * sizeof(float), sim.v.x);
+}
+
 static void copy_grid_to_gpu(void) {
-    cl_int err = clEnqueueWriteBuffer(
-        cmdq, /* command queue */
-        sim_mem, /* destination */
-        CL_TRUE, /* blocking */
-        offsetof(struct sim, nodes), /* offset of source */
-        sizeof(sim.nodes) + sizeof(sim.grid), /* size of copy */
-        &sim.nodes, /* source */
-        0, /* empty wait list */
-        NULL, 
-        NULL
-    );
-    if (err) {
-        die("clEnqueueWriteBuffer(%d)\n", err);
-    }
+    int n_cells = sim.grid_len * sim.grid_len * sim.grid_len;
+    write_buffer(cell_start_mem, (n_cells + 1) * sizeof(*sim.cell_start), 
+                 sim.cell_start);
+    write_buffer(sorted_mem, sim.n_balls * sizeof(*sim.sorted), sim.sorted);
 }
 
 static void symplectic_euler(void) {
@@ -198,7 +268,7 @@ static void symplectic_euler(void) {
         symplectic_euler_kernel, 
         1, 
         NULL, 
-        (size_t[]) {N_BALLS}, 
+        (size_t[]) {sim.n_balls}, 
         NULL, 
         0, 
         NULL, 
@@ -214,30 +284,17 @@ static void symplectic_euler(void) {
     clReleaseEvent(ev);
 }
 
-void resolve_pair_collisions(void) {
+static void resolve_pair_collisions(void) {
     cl_event ev;
     cl_int err;
-    err = clEnqueueWriteBuffer(
-        cmdq, /* command queue */
-        sim_mem, /* destination */
-        CL_TRUE, /* blocking */
-        offsetof(struct sim, tx), /* offset of destination */
-        24, /* size of copy */
-        &sim.tx, /* source */
-        0, /* empty wait list */
-        NULL, 
-        NULL
-    );
-    if (err) {
-        die("clEnqueueWriteBuffer(%d)\n", err);
-    }
+    size_t len = sim.grid_len;
     err = clEnqueueNDRangeKernel(
         cmdq, 
-        resolve_pair_collisions_kernel, 
+        resolve_pair_collisions_kernels[sim.pass % 27], 
         3, 
         NULL, 
-        (size_t[]) {GRID_LEN, GRID_LEN, GRID_LEN}, 
-	(size_t[]) {8, 8, 8},
+        (size_t[]) {len, len, len}, 
+        len % 8 ? NULL : (size_t[]) {8, 8, 8},
         0, 
         NULL, 
         &ev
@@ -264,7 +321,13 @@ void resolve_pair_collisions(void) {
     clReleaseEvent(ev);
 }
 
-void step_sim(void) {
+static void resolve_cross_collisions(void) {}
+
+static void parallel_grid_work(void(*work)(int)) {
+    work(0);
+}
+
+static void step_cl(void) {
     symplectic_euler();
     copy_balls_to_cpu();
     init_grid();
@@ -273,8 +336,20 @@ void step_sim(void) {
     copy_balls_to_cpu();
 }
 
-void print_profile(void) {
+static void print_cl_profile(void) {
 #ifdef USE_PROFILE
     printf("kernel: %ld ms\n", elapsed / 1000000);
 #endif
 }
+
+const struct backend cl_backend = {
+    .name = "cl",
+    .init = init_cl_backend,
+    .load = load_cl,
+    .unload = unload_cl,
+    .step = step_cl,
+    .print_profile = print_cl_profile,
+    .resolve_pair_collisions = resolve_pair_collisions,
+    .resolve_cross_collisions = resolve_cross_collisions,
+    .parallel_grid_work = parallel_grid_work,
+};
@@ -1,48 +1,115 @@
 #include "sim.h"
+#include "narrow.h"
+#include "misc.h"
 #include "worker.h"
+#include "profile.h"
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-void init_positions(void);
-void init_velocities(void);
 void init_grid(void);
+void restore_positions(void);
+void reorder_balls(void);
 void resolve_collisions(void);
+int nlist_expired(void);
+void save_nlist_positions(void);
+void resolve_jacobi_collisions(void);
 
-void init_sim(int argc, char **argv) {
-    init_positions();
-    init_velocities();
-    if (argc >= 2) {
-        n_workers = atoi(argv[1]);
+struct pair {
+    ball_idx i;
+    ball_idx j;
+};
+
+/* 
+ * neighbour pairs of each collision pass and worker, the passes keep the 
+ * cells of different workers apart so the lists can be resolved in 
+ * parallel until they are rebuilt
+ */
+struct pair_list {
+    struct pair *pairs;
+    int n;
+    int cap;
+};
+
+/* an occupied cell of the dense grid with its coordinates in its level */
+struct occupied_cell {
+    int c;
+    short x, y, z;
+};
+
+static struct pair_list *pair_lists;
+static int building;
+static struct occupied_cell *occupied;
+static int level_occupied[MAX_LEVELS + 1];
+static unsigned char *levels_below;
+
+static void init_mt(void) {
+    n_workers = sim.n_workers;
+    init_narrow(sim.narrow);
+    create_workers(sim.affinity);
+    sim.n_parts = n_workers;
+    if (sim.skin > 0.0f) {
+        int n_lists = sim.n_passes * n_workers;
+        pair_lists = xmalloc(n_lists * sizeof(*pair_lists));
+        memset(pair_lists, 0, n_lists * sizeof(*pair_lists));
     }
-    create_workers();
+    if (!sim.hashed && !sim.jacobi && 
+        (!sim.checkerboard || sim.n_levels > 1)) {
+        occupied = xmalloc(sim.n_balls * sizeof(*occupied));
+    }
+    if (occupied && sim.n_levels > 1) {
+        levels_below = xmalloc(sim.level_start[sim.n_levels - 1]);
+    }
+}
+
+static void load_mt(void) {
+    sim.n_parts = n_workers;
 }
 
+static void unload_mt(void) {}
+
 static float fclampf(float v, float l, float h) {
-    return fminf(fmaxf(v, l), h);
+    v = v < l ? l : v;
+    return v > h ? h : v;
 }
 
-static void symplectic_euler_worker(int worker_idx) {
-    int i = worker_idx * N_BALLS / n_workers;
-    int n = (worker_idx + 1) * N_BALLS / n_workers;
+static void integrate_axis(float *restrict x, float *restrict x0, 
+                           float *restrict v, const float *restrict r, 
+                           float a, int i, int n) {
+    float dt = sim.dt;
+    float h = sim.grid_len / 2;
     for (; i < n; i++) {
-        sim.v[i].y -= 10.0f * DT;
-        sim.x0[i] = sim.x[i];
-        sim.x[i] = vec4_muladds(sim.v[i], DT, sim.x[i]);
-        sim.x[i].x = fclampf(sim.x[i].x, GRID_MIN, GRID_MAX);
-        sim.x[i].y = fclampf(sim.x[i].y, GRID_MIN, GRID_MAX);
-        sim.x[i].z = fclampf(sim.x[i].z, GRID_MIN, GRID_MAX);
+        v[i] += a * dt;
+        x0[i] = x[i];
+        x[i] = fclampf(x[i] + v[i] * dt, r[i] - h, h - r[i]);
     }
 }
 
-static void newton_rasphon_worker(int worker_idx) {
-    int i = worker_idx * N_BALLS / n_workers;
-    int n = (worker_idx + 1) * N_BALLS / n_workers;
+static void difference_axis(float *restrict v, const float *restrict x, 
+                            const float *restrict x0, int i, int n) {
+    float sps = sim.sps;
     for (; i < n; i++) {
-        sim.v[i] = vec4_sub(sim.x[i], sim.x0[i]);
-        sim.v[i] = vec4_scale(sim.v[i], SPS);
+        v[i] = (x[i] - x0[i]) * sps;
     }
 }
 
+static void symplectic_euler_worker(int worker_idx) {
+    int i = worker_idx * sim.n_balls / n_workers;
+    int n = (worker_idx + 1) * sim.n_balls / n_workers;
+    integrate_axis(sim.x.x, sim.x0.x, sim.v.x, sim.r, 0.0f, i, n);
+    integrate_axis(sim.x.y, sim.x0.y, sim.v.y, sim.r, -10.0f, i, n);
+    integrate_axis(sim.x.z, sim.x0.z, sim.v.z, sim.r, 0.0f, i, n);
+}
+
+static void newton_rasphon_worker(int worker_idx) {
+    int i = worker_idx * sim.n_balls / n_workers;
+    int n = (worker_idx + 1) * sim.n_balls / n_workers;
+    difference_axis(sim.v.x, sim.x.x, sim.x0.x, i, n);
+    difference_axis(sim.v.y, sim.x.y, sim.x0.y, i, n);
+    difference_axis(sim.v.z, sim.x.z, sim.x0.z, i, n);
+}
+
 static void symplectic_euler(void) {
     parallel_work(symplectic_euler_worker);
 }
@@ -51,66 +118,522 @@ static void newton_rasphon(void) {
     parallel_work(newton_rasphon_worker);
 }
 
-static void resolve_ball_ball_collision(int i, int j) {
-    vec4s normal = vec4_sub(sim.x[i], sim.x[j]);
-    float d2 = vec4_norm2(normal);
-    if (d2 > 0.0f && d2 < DIAMETER * DIAMETER) {
-        float d = sqrtf(d2);
-        normal = vec4_divs(normal, d);
-        float corr = (DIAMETER - d) / 2.0f;
-        vec4s dx = vec4_scale(normal, corr);
-        sim.x[i] = vec4_add(sim.x[i], dx);
-        sim.x[j] = vec4_sub(sim.x[j], dx);
+static void push_pair(struct pair_list *list, int i, int j) {
+    if (list->n == list->cap) {
+        list->cap = list->cap ? 2 * list->cap : 256;
+        list->pairs = xrealloc(list->pairs, 
+                               list->cap * sizeof(*list->pairs));
     }
+    list->pairs[list->n++] = (struct pair) {i, j};
 }
 
-static void resolve_tile_tile_collisions(int i0, int j0) {
-    for (int i = i0; i >= 0; i = sim.nodes[i]) {
-        if (i0 == j0) {
-            for (int j = sim.nodes[i]; j >= 0; j = sim.nodes[j]) {
-                resolve_ball_ball_collision(i, j);
-            }
+static void collect_candidates(struct pair_list *list, int i, 
+                               const ball_idx *js, int n) {
+    for (int k = 0; k < n; k++) {
+        int j = js[k];
+        float cutoff = sim.r[i] + sim.r[j] + sim.skin;
+        float dx = sim.x.x[i] - sim.x.x[j];
+        float dy = sim.x.y[i] - sim.x.y[j];
+        float dz = sim.x.z[i] - sim.x.z[j];
+        if (dx * dx + dy * dy + dz * dz < cutoff * cutoff) {
+            push_pair(list, i, j);
+        }
+    }
+}
+
+static void visit_candidates(struct pair_list *list, int i, 
+                             const ball_idx *js, int n) {
+    if (list) {
+        collect_candidates(list, i, js, n);
+    } else {
+        resolve_ball_candidates(i, js, n);
+    }
+}
+
+static void resolve_tile_tile_collisions(struct pair_list *list, 
+                                         int c0, int c1) {
+    const ball_idx *balls = sim.cell_balls;
+    int i0 = sim.cell_start[c0];
+    int i1 = sim.cell_start[c0 + 1];
+    int j0 = sim.cell_start[c1];
+    int j1 = sim.cell_start[c1 + 1];
+    for (int k = i0; k < i1; k++) {
+        if (c0 == c1) {
+            visit_candidates(list, balls[k], balls + k + 1, i1 - k - 1);
         } else {
-            for (int j = j0; j >= 0; j = sim.nodes[j]) {
-                resolve_ball_ball_collision(i, j);
+            visit_candidates(list, balls[k], balls + j0, j1 - j0);
+        }
+    }
+}
+
+static void resolve_pair_list(const struct pair_list *list) {
+    count_tests(list->n);
+    for (int k = 0; k < list->n; k++) {
+        resolve_ball_ball_collision(list->pairs[k].i, list->pairs[k].j);
+    }
+}
+
+/* 
+ * the pair list of the worker in this pass, it is refilled while the 
+ * cells are walked if the lists are being built and resolved instead of 
+ * the cells otherwise, NULL without neighbour lists, every list is built 
+ * before any is resolved so they all see the positions the build saved
+ */
+static struct pair_list *pass_list(int worker_idx) {
+    if (sim.skin <= 0.0f) {
+        return NULL;
+    }
+    return &pair_lists[sim.pass * n_workers + worker_idx];
+}
+
+static void resolve_pass_list_worker(int worker_idx) {
+    resolve_pair_list(pass_list(worker_idx));
+}
+
+/* 
+ * resolve the lists of the pass if they are not due for a rebuild and 
+ * return 1, otherwise empty them for the chunks of the pass to fill
+ */
+static int resolve_pass_lists(void) {
+    if (sim.skin <= 0.0f) {
+        return 0;
+    }
+    if (!building) {
+        parallel_work(resolve_pass_list_worker);
+        return 1;
+    }
+    for (int w = 0; w < n_workers; w++) {
+        pass_list(w)->n = 0;
+    }
+    return 0;
+}
+
+/* 
+ * passes are cut into chunks for parallel_for, a worker that runs out 
+ * of chunks steals from the workers still busy with dense parts of the 
+ * grid
+ */
+static int chunk_grain(int n) {
+    return n / (sim.chunks * n_workers) + 1;
+}
+
+/* the tiles of a pass are 1 or 2 cells apart along each axis */
+static inline int in_pass(int x, int p, int n, int i, int len) {
+    return x >= p && x < len - n && !((x - p) & (i - 1));
+}
+
+/* 
+ * the occupied cells of the dense grid in cell order, the balls are 
+ * sorted by cell so a cell starts wherever the cell of a ball changes, 
+ * the cells of level l are occupied[level_occupied[l]] up to 
+ * occupied[level_occupied[l + 1]]
+ */
+static void list_occupied_cells(void) {
+    int n = 0;
+    int l = 0;
+    for (int k = 0; k < sim.n_balls; k++) {
+        int c = sim.ball_cells[sim.sorted[k]];
+        if (n && occupied[n - 1].c == c) {
+            continue;
+        }
+        for (; l < sim.n_levels && c >= sim.level_start[l]; l++) {
+            level_occupied[l] = n;
+        }
+        int x, y, z;
+        cell_coords(c, l - 1, &x, &y, &z);
+        occupied[n++] = (struct occupied_cell) {c, x, y, z};
+    }
+    for (; l <= sim.n_levels; l++) {
+        level_occupied[l] = n;
+    }
+}
+
+/* 
+ * bit l of levels_below[c] is set if balls of level l lie under coarse 
+ * cell c, so the cross passes skip the blocks of fine cells that are 
+ * empty
+ */
+static void mark_levels_below(void) {
+    memset(levels_below, 0, sim.level_start[sim.n_levels - 1]);
+    for (int l = 1; l < sim.n_levels; l++) {
+        for (int k = level_occupied[l]; k < level_occupied[l + 1]; k++) {
+            const struct occupied_cell *o = &occupied[k];
+            for (int c = 0; c < l; c++) {
+                int s = l - c;
+                int cc = cell_idx(c, o->x >> s, o->y >> s, o->z >> s);
+                levels_below[cc] |= 1 << l;
+            }
+        }
+    }
+}
+
+/* 
+ * the chunks are runs of the occupied cells of the level and pair the 
+ * ones the pass starts a tile pair at with the tile next to them, which 
+ * is in the grid as the pass stops short of the far side
+ */
+static void resolve_occupied_tiles(int worker_idx, int ki, int kf, 
+                                   void *ctx) {
+    (void) ctx;
+    struct pair_list *list = pass_list(worker_idx);
+    const struct stencil *s = &sim.stencil;
+    int l = sim.level;
+    int len = sim.level_len[l];
+    int dc = (s->tx * len + s->ty) * len + s->tz;
+    for (int k = ki; k < kf; k++) {
+        const struct occupied_cell *o = &occupied[k];
+        if (in_pass(o->x, s->px, s->nx, s->ix, len) && 
+            in_pass(o->y, s->py, s->ny, s->iy, len) &&
+            in_pass(o->z, s->pz, s->nz, s->iz, len)) {
+            resolve_tile_tile_collisions(list, o->c, o->c + dc);
+        }
+    }
+}
+
+/* 
+ * inlined into one copy per pass below, so the offsets and strides of 
+ * the stencil are constants and the neighbour tile is a fixed distance 
+ * away from the tile, the chunks are rows of tiles along z
+ */
+static inline __attribute__((always_inline)) 
+void resolve_dense_tiles(int worker_idx, int r0, int r1, struct stencil s) {
+    struct pair_list *list = pass_list(worker_idx);
+    int l = sim.level;
+    int len = sim.level_len[l];
+    int ly = (len - s.py - s.ny + s.iy - 1) / s.iy;
+    int zi = s.pz;
+    int zf = len - s.nz;
+    int dc = (s.tx * len + s.ty) * len + s.tz;
+    for (int r = r0; r < r1; r++) {
+        int x = r / ly * s.ix + s.px;
+        int y = r % ly * s.iy + s.py;
+        for (int z = zi; z < zf; z += s.iz) {
+            int c0 = cell_idx(l, x, y, z);
+            resolve_tile_tile_collisions(list, c0, c0 + dc);
+        }
+    }
+}
+
+#define DENSE_PASS(i) \
+    static void resolve_dense_tiles_##i(int w, int r0, int r1, void *ctx) { \
+        (void) ctx; \
+        resolve_dense_tiles(w, r0, r1, pass_stencil(i)); \
+    }
+
+DENSE_PASS(0) DENSE_PASS(1) DENSE_PASS(2) DENSE_PASS(3) DENSE_PASS(4)
+DENSE_PASS(5) DENSE_PASS(6) DENSE_PASS(7) DENSE_PASS(8) DENSE_PASS(9)
+DENSE_PASS(10) DENSE_PASS(11) DENSE_PASS(12) DENSE_PASS(13) DENSE_PASS(14)
+DENSE_PASS(15) DENSE_PASS(16) DENSE_PASS(17) DENSE_PASS(18) DENSE_PASS(19)
+DENSE_PASS(20) DENSE_PASS(21) DENSE_PASS(22) DENSE_PASS(23) DENSE_PASS(24)
+DENSE_PASS(25) DENSE_PASS(26)
+
+static void(*const dense_passes[27])(int, int, int, void *) = {
+    resolve_dense_tiles_0, resolve_dense_tiles_1, resolve_dense_tiles_2, 
+    resolve_dense_tiles_3, resolve_dense_tiles_4, resolve_dense_tiles_5, 
+    resolve_dense_tiles_6, resolve_dense_tiles_7, resolve_dense_tiles_8, 
+    resolve_dense_tiles_9, resolve_dense_tiles_10, resolve_dense_tiles_11, 
+    resolve_dense_tiles_12, resolve_dense_tiles_13, resolve_dense_tiles_14, 
+    resolve_dense_tiles_15, resolve_dense_tiles_16, resolve_dense_tiles_17, 
+    resolve_dense_tiles_18, resolve_dense_tiles_19, resolve_dense_tiles_20, 
+    resolve_dense_tiles_21, resolve_dense_tiles_22, resolve_dense_tiles_23, 
+    resolve_dense_tiles_24, resolve_dense_tiles_25, resolve_dense_tiles_26
+};
+
+/* 
+ * a grid twice the side of the lattice and the finer levels of a 
+ * multi-level grid are mostly empty, a pass over a level with fewer 
+ * occupied cells than tiles walks the occupied ones, the tiles are 
+ * apart either way so both resolve the same pairs alike
+ */
+static void resolve_dense_pass(void) {
+    const struct stencil *s = &sim.stencil;
+    int len = sim.level_len[sim.level];
+    int lx = (len - s->px - s->nx + s->ix - 1) / s->ix;
+    int ly = (len - s->py - s->ny + s->iy - 1) / s->iy;
+    int lz = (len - s->pz - s->nz + s->iz - 1) / s->iz;
+    int n = lx * ly;
+    if (occupied) {
+        int first = level_occupied[sim.level];
+        int last = level_occupied[sim.level + 1];
+        if (last - first < (long) n * lz) {
+            parallel_for(first, last, chunk_grain(last - first), 
+                         resolve_occupied_tiles, NULL);
+            return;
+        }
+    }
+    parallel_for(0, n, chunk_grain(n), dense_passes[sim.pass % 27], NULL);
+}
+
+static inline int min(int a, int b) {
+    return a < b ? a : b;
+}
+
+/* 
+ * pair the balls of a cell with each other and with the half shell, the 
+ * cells of a row along z follow each other so the rest of the cell and 
+ * the next one along z are a single run of balls, as are the three cells 
+ * of each of the four rows ahead
+ */
+static void resolve_half_shell(struct pair_list *list, int l, 
+                               int x, int y, int z) {
+    int len = sim.level_len[l];
+    int c0 = cell_idx(l, x, y, z);
+    int k0 = sim.cell_start[c0];
+    int k1 = sim.cell_start[c0 + 1];
+    if (k0 == k1) {
+        return;
+    }
+    int z0 = z > 0 ? z - 1 : 0;
+    int z1 = min(z + 2, len);
+    int rows[4][2];
+    int n = 0;
+    for (int dx = 0; dx <= 1; dx++) {
+        for (int dy = -dx; dy <= 1; dy++) {
+            if ((dx || dy) && x + dx < len && y + dy >= 0 && 
+                y + dy < len) {
+                int c = cell_idx(l, x + dx, y + dy, 0);
+                rows[n][0] = sim.cell_start[c + z0];
+                rows[n][1] = sim.cell_start[c + z1];
+                n++;
             }
         }
     }
+    int j1 = sim.cell_start[c0 + (z + 1 < len) + 1];
+    const ball_idx *balls = sim.cell_balls;
+    for (int k = k0; k < k1; k++) {
+        visit_candidates(list, balls[k], balls + k + 1, j1 - k - 1);
+        for (int r = 0; r < n; r++) {
+            visit_candidates(list, balls[k], balls + rows[r][0], 
+                             rows[r][1] - rows[r][0]);
+        }
+    }
 }
 
-static void resolve_pair_collisions_worker(int worker_idx) {
-    int lx = (GRID_LEN - sim.px - sim.nx + sim.ix - 1) / sim.ix;
-    int xi = worker_idx * lx / n_workers * sim.ix + sim.px;
-    int xf = (worker_idx + 1) * lx / n_workers * sim.ix + sim.px;
-    int yi = sim.py;
-    int yf = GRID_LEN - sim.ny; 
-    int zi = sim.pz;
-    int zf = GRID_LEN - sim.nz;
-    int ix = sim.ix;
-    int iy = sim.iy;
-    int iz = sim.iz;
-    for (int x = xi; x < xf; x += ix) {
-        for (int y = yi; y < yf; y += iy) {
-            for (int z = zi; z < zf; z += iz) {
-                int i = sim.grid[x][y][z];
-                int j = sim.grid[x + sim.tx][y + sim.ty][z + sim.tz];
-                resolve_tile_tile_collisions(i, j);
+/* 
+ * with -C the cells form 2x2x2 blocks coloured by the parities of the 
+ * block coordinates, blocks of one colour are two cells apart so the 
+ * half shells of their cells never touch and the workers split them 
+ * between themselves in a single pass per colour
+ */
+static void resolve_dense_blocks(int worker_idx, int b0, int b1, 
+                                 void *ctx) {
+    (void) ctx;
+    struct pair_list *list = pass_list(worker_idx);
+    int l = sim.level;
+    int len = sim.level_len[l];
+    int cx = sim.colour & 1;
+    int cy = sim.colour >> 1 & 1;
+    int cz = sim.colour >> 2;
+    int blocks = (len + 1) / 2;
+    int ny = (blocks - cy + 1) / 2;
+    int nz = (blocks - cz + 1) / 2;
+    for (int b = b0; b < b1; b++) {
+        int x0 = 4 * (b / nz / ny) + 2 * cx;
+        int y0 = 4 * (b / nz % ny) + 2 * cy;
+        int z0 = 4 * (b % nz) + 2 * cz;
+        for (int x = x0; x < min(x0 + 2, len); x++) {
+            for (int y = y0; y < min(y0 + 2, len); y++) {
+                for (int z = z0; z < min(z0 + 2, len); z++) {
+                    resolve_half_shell(list, l, x, y, z);
+                }
             }
         }
     }
 }
 
-void resolve_pair_collisions(void) {
-    parallel_work(resolve_pair_collisions_worker);
+static void resolve_block_pass(void) {
+    int blocks = (sim.level_len[sim.level] + 1) / 2;
+    int nx = (blocks - (sim.colour & 1) + 1) / 2;
+    int ny = (blocks - (sim.colour >> 1 & 1) + 1) / 2;
+    int nz = (blocks - (sim.colour >> 2) + 1) / 2;
+    int n = nx * ny * nz;
+    parallel_for(0, n, chunk_grain(n), resolve_dense_blocks, NULL);
+}
+
+/* 
+ * only occupied cells exist, the chunks are runs of those of the level 
+ * and pair the ones the pass starts a tile pair at
+ */
+static void resolve_hashed_tiles(int worker_idx, int ci, int cf, 
+                                 void *ctx) {
+    (void) ctx;
+    struct pair_list *list = pass_list(worker_idx);
+    const struct stencil *s = &sim.stencil;
+    int l = sim.level;
+    int len = sim.level_len[l];
+    for (int c0 = ci; c0 < cf; c0++) {
+        int x, y, z;
+        cell_coords(c0, l, &x, &y, &z);
+        if (!in_pass(x, s->px, s->nx, s->ix, len) || 
+            !in_pass(y, s->py, s->ny, s->iy, len) ||
+            !in_pass(z, s->pz, s->nz, s->iz, len)) {
+            continue;
+        }
+        int c1 = find_cell(cell_key(l, x + s->tx, y + s->ty, z + s->tz));
+        if (c1 >= 0) {
+            resolve_tile_tile_collisions(list, c0, c1);
+        }
+    }
+}
+
+static void resolve_hashed_pass(void) {
+    int first = sim.level_start[sim.level];
+    int last = sim.level_start[sim.level + 1];
+    parallel_for(first, last, chunk_grain(last - first), 
+                 resolve_hashed_tiles, NULL);
+}
+
+static void resolve_pair_collisions(void) {
+    profile_pass(sim.pass);
+    if (resolve_pass_lists()) {
+        return;
+    }
+    if (sim.checkerboard) {
+        resolve_block_pass();
+    } else if (sim.hashed) {
+        resolve_hashed_pass();
+    } else {
+        resolve_dense_pass();
+    }
 }
 
-void step_sim(void) {
+/* 
+ * pair the balls of coarse cell c with the fine balls under its neighbour
+ * x1, y1, z1, the rows along z of that cube of fine cells are contiguous
+ */
+static void resolve_cross_cell(struct pair_list *list, int c, 
+                               int x1, int y1, int z1) {
+    const ball_idx *balls = sim.cell_balls;
+    int l = sim.level;
+    int s = l - sim.coarse;
+    int k1 = sim.cell_start[c + 1];
+    for (int k = sim.cell_start[c]; k < k1; k++) {
+        for (int fx = x1 << s; fx < (x1 + 1) << s; fx++) {
+            for (int fy = y1 << s; fy < (y1 + 1) << s; fy++) {
+                int j0, j1;
+                row_balls(l, fx, fy, z1 << s, (z1 + 1) << s, &j0, &j1);
+                visit_candidates(list, balls[k], balls + j0, j1 - j0);
+            }
+        }
+    }
+}
+
+/* 
+ * every coarse cell meets a different block of fine cells in a pass, so 
+ * the chunks can split the coarse cells any way they like
+ */
+static void resolve_cross_cells(int worker_idx, int ci, int cf, void *ctx) {
+    (void) ctx;
+    struct pair_list *list = pass_list(worker_idx);
+    int o = sim.neighbour;
+    int dx = o % 3 - 1;
+    int dy = o / 3 % 3 - 1;
+    int dz = o / 9 - 1;
+    int l = sim.coarse;
+    int len = sim.level_len[l];
+    for (int c = ci; c < cf; c++) {
+        if (sim.cell_start[c] == sim.cell_start[c + 1]) {
+            continue;
+        }
+        int x, y, z;
+        cell_coords(c, l, &x, &y, &z);
+        x += dx;
+        y += dy;
+        z += dz;
+        if (x < 0 || x >= len || y < 0 || y >= len || z < 0 || z >= len) {
+            continue;
+        }
+        if (!levels_below || 
+            levels_below[cell_idx(l, x, y, z)] & 1 << sim.level) {
+            resolve_cross_cell(list, c, x, y, z);
+        }
+    }
+}
+
+static void resolve_cross_collisions(void) {
+    profile_pass(sim.pass);
+    if (resolve_pass_lists()) {
+        return;
+    }
+    int first = sim.level_start[sim.coarse];
+    int last = sim.level_start[sim.coarse + 1];
+    parallel_for(first, last, chunk_grain(last - first), 
+                 resolve_cross_cells, NULL);
+}
+
+static void parallel_grid_work(void(*work)(int)) {
+    parallel_work(work);
+}
+
+/* 
+ * the passes over the dense grid walk the occupied cells of the levels 
+ * and skip empty blocks of fine cells, the hashed grid and the Jacobi 
+ * iterations do not
+ */
+static void init_mt_grid(void) {
+    init_grid();
+    if (occupied) {
+        list_occupied_cells();
+    }
+    if (levels_below) {
+        mark_levels_below();
+    }
+}
+
+static void step_mt(void) {
+    profile_section(PHASE_REORDER);
+    reorder_balls();
     activate_workers();
+    profile_section(PHASE_INTEGRATE);
     symplectic_euler();
-    init_grid();
-    resolve_collisions();
+    if (sim.skin > 0.0f) {
+        building = nlist_expired();
+        if (building) {
+            profile_section(PHASE_GRID);
+            init_mt_grid();
+            save_nlist_positions();
+            profile_section(PHASE_COLLIDE);
+            resolve_collisions();
+            building = 0;
+        }
+        profile_section(PHASE_COLLIDE);
+        resolve_collisions();
+    } else {
+        profile_section(PHASE_GRID);
+        init_mt_grid();
+        profile_section(PHASE_COLLIDE);
+        if (sim.jacobi) {
+            resolve_jacobi_collisions();
+        } else {
+            resolve_collisions();
+        }
+        profile_section(PHASE_GRID);
+        restore_positions();
+    }
+    profile_section(PHASE_VELOCITY);
     newton_rasphon();
     deactivate_workers();
+    profile_section(-1);
+}
+
+static void print_mt_profile(void) {
+    print_phases();
+    if (sim.skin > 0.0f) {
+        printf("neighbour list builds: %d\n", sim.n_rebuilds);
+    }
+#ifdef USE_PROFILE
+    printf("pair tests: %ld\n", sim.n_tests);
+#endif
 }
 
-void print_profile(void) {}
+const struct backend mt_backend = {
+    .name = "mt",
+    .init = init_mt,
+    .load = load_mt,
+    .unload = unload_mt,
+    .step = step_mt,
+    .print_profile = print_mt_profile,
+    .resolve_pair_collisions = resolve_pair_collisions,
+    .resolve_cross_collisions = resolve_cross_collisions,
+    .parallel_grid_work = parallel_grid_work,
+};
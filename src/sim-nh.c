@@ -1,49 +1,85 @@
 #include "sim.h"
+#include "misc.h"
 #include "worker.h"
+#include "profile.h"
 #include <math.h>
 #include <string.h>
 
-void init_positions(void);
-void init_velocities(void);
 void init_grid(void);
 
-void init_sim(int argc, char **argv) {
-    init_positions();
-    init_velocities();
+/* every ball meets every other, so nothing of the grid applies */
+static void init_nh(void) {
+    if (sim.reorder || sim.morton_steps || sim.skin > 0.0f || 
+        sim.n_levels > 1 || sim.hashed || sim.checkerboard || sim.jacobi) {
+        die("-R, -M, -K, -L, -H, -C and -J are not supported by the "
+            "backend without a grid\n");
+    }
+    sim.n_parts = 1;
+}
+
+static void load_nh(void) {
+    sim.n_parts = 1;
 }
 
+static void unload_nh(void) {}
+
 static float fclampf(float v, float l, float h) {
-    return fminf(fmaxf(v, l), h);
+    v = v < l ? l : v;
+    return v > h ? h : v;
 }
 
-static void symplectic_euler(void) {
-    for (int i = 0; i < N_BALLS; i++) {
-        sim.v[i].y -= 10.0f * DT;
-        sim.x0[i] = sim.x[i];
-        sim.x[i] = vec4_muladds(sim.v[i], DT, sim.x[i]);
-        sim.x[i].x = fclampf(sim.x[i].x, GRID_MIN, GRID_MAX);
-        sim.x[i].y = fclampf(sim.x[i].y, GRID_MIN, GRID_MAX);
-        sim.x[i].z = fclampf(sim.x[i].z, GRID_MIN, GRID_MAX);
+static void integrate_axis(float *restrict x, float *restrict x0, 
+                           float *restrict v, const float *restrict r, 
+                           float a, int i, int n) {
+    float dt = sim.dt;
+    float h = sim.grid_len / 2;
+    for (; i < n; i++) {
+        v[i] += a * dt;
+        x0[i] = x[i];
+        x[i] = fclampf(x[i] + v[i] * dt, r[i] - h, h - r[i]);
     }
 }
 
-static void newton_rasphon(void) {
-    for (int i = 0; i < N_BALLS; i++) {
-        sim.v[i] = vec4_sub(sim.x[i], sim.x0[i]);
-        sim.v[i] = vec4_scale(sim.v[i], SPS);
+static void difference_axis(float *restrict v, const float *restrict x, 
+                            const float *restrict x0, int i, int n) {
+    float sps = sim.sps;
+    for (; i < n; i++) {
+        v[i] = (x[i] - x0[i]) * sps;
     }
 }
 
+static void symplectic_euler(void) {
+    int n = sim.n_balls;
+    integrate_axis(sim.x.x, sim.x0.x, sim.v.x, sim.r, 0.0f, 0, n);
+    integrate_axis(sim.x.y, sim.x0.y, sim.v.y, sim.r, -10.0f, 0, n);
+    integrate_axis(sim.x.z, sim.x0.z, sim.v.z, sim.r, 0.0f, 0, n);
+}
+
+static void newton_rasphon(void) {
+    int n = sim.n_balls;
+    difference_axis(sim.v.x, sim.x.x, sim.x0.x, 0, n);
+    difference_axis(sim.v.y, sim.x.y, sim.x0.y, 0, n);
+    difference_axis(sim.v.z, sim.x.z, sim.x0.z, 0, n);
+}
+
 static void resolve_ball_ball_collision(int i, int j) {
-    vec4s normal = vec4_sub(sim.x[i], sim.x[j]);
-    float d2 = vec4_norm2(normal);
-    if (d2 > 0.0f && d2 < DIAMETER * DIAMETER) {
+    float nx = sim.x.x[i] - sim.x.x[j];
+    float ny = sim.x.y[i] - sim.x.y[j];
+    float nz = sim.x.z[i] - sim.x.z[j];
+    float d2 = nx * nx + ny * ny + nz * nz;
+    float contact = sim.r[i] + sim.r[j];
+    if (d2 > 0.0f && d2 < contact * contact) {
         float d = sqrtf(d2);
-        normal = vec4_divs(normal, d);
-        float corr = (DIAMETER - d) / 2.0f;
-        vec4s dx = vec4_scale(normal, corr);
-        sim.x[i] = vec4_add(sim.x[i], dx);
-        sim.x[j] = vec4_sub(sim.x[j], dx);
+        float corr = (contact - d) / (sim.w[i] + sim.w[j]);
+        float dx = nx / d * corr;
+        float dy = ny / d * corr;
+        float dz = nz / d * corr;
+        sim.x.x[i] += dx * sim.w[i];
+        sim.x.y[i] += dy * sim.w[i];
+        sim.x.z[i] += dz * sim.w[i];
+        sim.x.x[j] -= dx * sim.w[j];
+        sim.x.y[j] -= dy * sim.w[j];
+        sim.x.z[j] -= dz * sim.w[j];
     }
 }
 
@@ -56,18 +92,42 @@ static inline int max(int a, int b) {
 }
 
 static void resolve_collisions(void) {
-    for (int i = 0; i < N_BALLS; i++) {
+    for (int i = 0; i < sim.n_balls; i++) {
         for (int j = 0; j < i; j++) {
             resolve_ball_ball_collision(i, j);
         }
     }
 }
 
-void step_sim(void) {
+static void step_nh(void) {
+    profile_section(PHASE_INTEGRATE);
     symplectic_euler();
+    profile_section(PHASE_VELOCITY);
     newton_rasphon();
+    profile_section(PHASE_COLLIDE);
     resolve_collisions();
+    profile_section(-1);
+}
+
+static void print_nh_profile(void) {
+    print_phases();
+}
+
+static void resolve_pair_collisions(void) {}
+static void resolve_cross_collisions(void) {}
+
+static void parallel_grid_work(void(*work)(int)) {
+    work(0);
 }
 
-void print_profile(void) {}
-void resolve_pair_collisions(void) {}
+const struct backend nh_backend = {
+    .name = "nh",
+    .init = init_nh,
+    .load = load_nh,
+    .unload = unload_nh,
+    .step = step_nh,
+    .print_profile = print_nh_profile,
+    .resolve_pair_collisions = resolve_pair_collisions,
+    .resolve_cross_collisions = resolve_cross_collisions,
+    .parallel_grid_work = parallel_grid_work,
+};
@@ -1,50 +1,74 @@
 #include "sim.h"
+#include "narrow.h"
+#include "misc.h"
 #include "worker.h"
+#include "profile.h"
 #include <math.h>
+#include <stdio.h>
 #include <string.h>
 
-void init_positions(void);
-void init_velocities(void);
 void init_grid(void);
+void restore_positions(void);
+void reorder_balls(void);
+int nlist_expired(void);
+void save_nlist_positions(void);
+void resolve_jacobi_collisions(void);
 
-void init_sim(int argc, char **argv) {
-    init_positions();
-    init_velocities();
+static ball_idx *nbrs;
+static int *nbr_start;
+static int nbr_cap;
+
+static void init_st(void) {
+    init_narrow(sim.narrow);
+    if (sim.skin > 0.0f) {
+        nbr_start = xmalloc((sim.n_balls + 1) * sizeof(*nbr_start));
+    }
+    sim.n_parts = 1;
+}
+
+static void load_st(void) {
+    sim.n_parts = 1;
 }
 
+static void unload_st(void) {}
+
 static float fclampf(float v, float l, float h) {
-    return fminf(fmaxf(v, l), h);
+    v = v < l ? l : v;
+    return v > h ? h : v;
 }
 
-static void symplectic_euler(void) {
-    for (int i = 0; i < N_BALLS; i++) {
-        sim.v[i].y -= 10.0f * DT;
-        sim.x0[i] = sim.x[i];
-        sim.x[i] = vec4_muladds(sim.v[i], DT, sim.x[i]);
-        sim.x[i].x = fclampf(sim.x[i].x, GRID_MIN, GRID_MAX);
-        sim.x[i].y = fclampf(sim.x[i].y, GRID_MIN, GRID_MAX);
-        sim.x[i].z = fclampf(sim.x[i].z, GRID_MIN, GRID_MAX);
+static void integrate_axis(float *restrict x, float *restrict x0, 
+                           float *restrict v, const float *restrict r, 
+                           float a, int i, int n) {
+    float dt = sim.dt;
+    float h = sim.grid_len / 2;
+    for (; i < n; i++) {
+        v[i] += a * dt;
+        x0[i] = x[i];
+        x[i] = fclampf(x[i] + v[i] * dt, r[i] - h, h - r[i]);
     }
 }
 
-static void newton_rasphon(void) {
-    for (int i = 0; i < N_BALLS; i++) {
-        sim.v[i] = vec4_sub(sim.x[i], sim.x0[i]);
-        sim.v[i] = vec4_scale(sim.v[i], SPS);
+static void difference_axis(float *restrict v, const float *restrict x, 
+                            const float *restrict x0, int i, int n) {
+    float sps = sim.sps;
+    for (; i < n; i++) {
+        v[i] = (x[i] - x0[i]) * sps;
     }
 }
 
-static void resolve_ball_ball_collision(int i, int j) {
-    vec4s normal = vec4_sub(sim.x[i], sim.x[j]);
-    float d2 = vec4_norm2(normal);
-    if (d2 > 0.0f && d2 < DIAMETER * DIAMETER) {
-        float d = sqrtf(d2);
-        normal = vec4_divs(normal, d);
-        float corr = (DIAMETER - d) / 2.0f;
-        vec4s dx = vec4_scale(normal, corr);
-        sim.x[i] = vec4_add(sim.x[i], dx);
-        sim.x[j] = vec4_sub(sim.x[j], dx);
-    }
+static void symplectic_euler(void) {
+    int n = sim.n_balls;
+    integrate_axis(sim.x.x, sim.x0.x, sim.v.x, sim.r, 0.0f, 0, n);
+    integrate_axis(sim.x.y, sim.x0.y, sim.v.y, sim.r, -10.0f, 0, n);
+    integrate_axis(sim.x.z, sim.x0.z, sim.v.z, sim.r, 0.0f, 0, n);
+}
+
+static void newton_rasphon(void) {
+    int n = sim.n_balls;
+    difference_axis(sim.v.x, sim.x.x, sim.x0.x, 0, n);
+    difference_axis(sim.v.y, sim.x.y, sim.x0.y, 0, n);
+    difference_axis(sim.v.z, sim.x.z, sim.x0.z, 0, n);
 }
 
 static inline int min(int a, int b) {
@@ -55,35 +79,185 @@ static inline int max(int a, int b) {
     return a > b ? a : b;
 }
 
+struct row {
+    int j0;
+    int j1;
+};
+
+/* 
+ * the rows of the 3x3x3 cells around cell x, y, z of level l, or with 
+ * half only the four rows ahead of it that make up a half shell with the 
+ * row of the cell itself
+ */
+static int level_rows(struct row *rows, int l, int x, int y, int z, 
+                      int half) {
+    int len = sim.level_len[l];
+    int z0 = max(z - 1, 0);
+    int z1 = min(z + 2, len);
+    int n = 0;
+    for (int dx = -1; dx <= 1; dx++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            int rx = x + dx;
+            int ry = y + dy;
+            if ((half && (dx < 0 || (!dx && dy <= 0))) || 
+                rx < 0 || rx >= len || ry < 0 || ry >= len) {
+                continue;
+            }
+            row_balls(l, rx, ry, z0, z1, &rows[n].j0, &rows[n].j1);
+            n += rows[n].j0 < rows[n].j1;
+        }
+    }
+    return n;
+}
+
+/* 
+ * the non-empty rows of cells around cell x, y, z of level l, a ball 
+ * looks for partners in its own level and the coarser ones, their cells 
+ * are wide enough to hold any pair it is part of
+ */
+static int neighbour_rows(struct row *rows, int l, int x, int y, int z, 
+                          int half) {
+    int n = level_rows(rows, l, x, y, z, half);
+    for (int c = 0; c < l; c++) {
+        int s = l - c;
+        n += level_rows(rows + n, c, x >> s, y >> s, z >> s, 0);
+    }
+    return n;
+}
+
 static void resolve_collisions(void) {
-    for (int i = 0; i < N_BALLS; i++) {
-        int x = sim.x[i].x + GRID_LEN / 2;
-        int y = sim.x[i].y + GRID_LEN / 2;
-        int z = sim.x[i].z + GRID_LEN / 2;
-        int x0 = max(x - 1, 0);
-        int y0 = max(y - 1, 0);
-        int z0 = max(z - 1, 0);
-        int x1 = min(x + 2, GRID_LEN);
-        int y1 = min(y + 2, GRID_LEN);
-        int z1 = min(z + 2, GRID_LEN);
-        for (x = x0; x < x1; x++) {
-            for (y = y0; y < y1; y++) {
-                for (z = z0; z < z1; z++) {
-                    for (int j = sim.grid[x][y][z]; j >= 0; j = sim.nodes[j]) {
-                        resolve_ball_ball_collision(i, j);
-                    }
+    struct row rows[9 * MAX_LEVELS];
+    for (int l = 0; l < sim.n_levels; l++) {
+        for (int c = sim.level_start[l]; c < sim.level_start[l + 1]; c++) {
+            int k0 = sim.cell_start[c];
+            int k1 = sim.cell_start[c + 1];
+            if (k0 == k1) {
+                continue;
+            }
+            int x, y, z;
+            cell_coords(c, l, &x, &y, &z);
+            int n = neighbour_rows(rows, l, x, y, z, 1);
+            /* the rest of the cell and the next one along z */
+            int j0, j1;
+            row_balls(l, x, y, z, min(z + 2, sim.level_len[l]), &j0, &j1);
+            for (int k = k0; k < k1; k++) {
+                resolve_ball_candidates(sim.cell_balls[k], 
+                                        sim.cell_balls + k + 1, 
+                                        j1 - k - 1);
+                for (int r = 0; r < n; r++) {
+                    int j0 = rows[r].j0;
+                    resolve_ball_candidates(sim.cell_balls[k], 
+                                            sim.cell_balls + j0, 
+                                            rows[r].j1 - j0);
                 }
             }
         }
     }
 }
 
-void step_sim(void) {
+static void push_neighbour(int k, int j) {
+    if (k == nbr_cap) {
+        nbr_cap = nbr_cap ? 2 * nbr_cap : sim.n_balls;
+        nbrs = xrealloc(nbrs, nbr_cap * sizeof(*nbrs));
+    }
+    nbrs[k] = j;
+}
+
+/* 
+ * list each pair closer than the sum of its radii plus skin once, under
+ * its lower index or its smaller ball
+ */
+static void build_neighbours(void) {
+    struct row rows[9 * MAX_LEVELS];
+    int k = 0;
+    for (int i = 0; i < sim.n_balls; i++) {
+        nbr_start[i] = k;
+        int l = ball_level(i);
+        int x = level_coord(sim.x.x[i], l);
+        int y = level_coord(sim.x.y[i], l);
+        int z = level_coord(sim.x.z[i], l);
+        int n = neighbour_rows(rows, l, x, y, z, 0);
+        for (int r = 0; r < n; r++) {
+            for (int m = rows[r].j0; m < rows[r].j1; m++) {
+                int j = sim.cell_balls[m];
+                float cutoff = sim.r[i] + sim.r[j] + sim.skin;
+                float dx = sim.x.x[i] - sim.x.x[j];
+                float dy = sim.x.y[i] - sim.x.y[j];
+                float dz = sim.x.z[i] - sim.x.z[j];
+                float d2 = dx * dx + dy * dy + dz * dz;
+                if ((ball_level(j) < l || j > i) && d2 < cutoff * cutoff) {
+                    push_neighbour(k++, j);
+                }
+            }
+        }
+    }
+    nbr_start[sim.n_balls] = k;
+}
+
+static void resolve_neighbours(void) {
+    for (int i = 0; i < sim.n_balls; i++) {
+        int k0 = nbr_start[i];
+        int k1 = nbr_start[i + 1];
+        resolve_ball_candidates(i, nbrs + k0, k1 - k0);
+    }
+}
+
+static void step_st(void) {
+    profile_section(PHASE_REORDER);
+    reorder_balls();
+    profile_section(PHASE_INTEGRATE);
     symplectic_euler();
-    init_grid();
-    resolve_collisions();
+    if (sim.skin > 0.0f) {
+        if (nlist_expired()) {
+            profile_section(PHASE_GRID);
+            init_grid();
+            build_neighbours();
+            save_nlist_positions();
+        }
+        profile_section(PHASE_COLLIDE);
+        resolve_neighbours();
+    } else {
+        profile_section(PHASE_GRID);
+        init_grid();
+        profile_section(PHASE_COLLIDE);
+        if (sim.jacobi) {
+            resolve_jacobi_collisions();
+        } else {
+            resolve_collisions();
+        }
+        profile_section(PHASE_GRID);
+        restore_positions();
+    }
+    profile_section(PHASE_VELOCITY);
     newton_rasphon();
+    profile_section(-1);
+}
+
+static void print_st_profile(void) {
+    print_phases();
+    if (sim.skin > 0.0f) {
+        printf("neighbour list builds: %d\n", sim.n_rebuilds);
+    }
+#ifdef USE_PROFILE
+    printf("pair tests: %ld\n", sim.n_tests);
+#endif
+}
+
+static void resolve_pair_collisions(void) {}
+static void resolve_cross_collisions(void) {}
+
+static void parallel_grid_work(void(*work)(int)) {
+    work(0);
 }
 
-void print_profile(void) {}
-void resolve_pair_collisions(void) {}
+const struct backend st_backend = {
+    .name = "st",
+    .init = init_st,
+    .load = load_st,
+    .unload = unload_st,
+    .step = step_st,
+    .print_profile = print_st_profile,
+    .resolve_pair_collisions = resolve_pair_collisions,
+    .resolve_cross_collisions = resolve_cross_collisions,
+    .parallel_grid_work = parallel_grid_work,
+};
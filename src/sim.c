@@ -1,90 +1,1019 @@
+#define _GNU_SOURCE
 #include "sim.h"
-#include "worker.h"
+#include "misc.h"
+#include "profile.h"
+#include "tune.h"
+#include <limits.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 struct sim sim;
 
-void resolve_pair_collisions(void);
+/* 
+ * the backends are referenced weakly so every program links the ones it 
+ * needs, sim.default_backend or else the first linked one runs unless -b 
+ * picks others
+ */
+extern const struct backend st_backend __attribute__((weak));
+extern const struct backend mt_backend __attribute__((weak));
+extern const struct backend nh_backend __attribute__((weak));
+extern const struct backend cl_backend __attribute__((weak));
 
-void init_positions(void) {
-    for (int i = 0; i < N_BALLS; i++) {
-        sim.x[i].x = i % 16 - GRID_LEN / 4 + 0.5f;
-        sim.x[i].y = i / 16 % 16 - GRID_LEN / 4 + 0.5f;
-        sim.x[i].z = i / 256 - GRID_LEN / 4 + 0.5f;
+static const struct backend *const linked_backends[] = {
+    &st_backend, &mt_backend, &nh_backend, &cl_backend
+};
+
+static void resolve_pair_collisions(void) {
+    sim.backend->resolve_pair_collisions();
+}
+
+static void resolve_cross_collisions(void) {
+    sim.backend->resolve_cross_collisions();
+}
+
+static void parallel_grid_work(void(*work)(int)) {
+    sim.backend->parallel_grid_work(work);
+}
+
+static int tunable;
+
+static void usage(const char *prog) {
+    die("usage: %s [-n balls] [-g grid length] [-r radius] "
+        "[-s steps per second] [-t seconds] [-w workers] "
+        "[-A compact|scatter] [-N scalar|avx2|avx512] [-R] [-M steps] "
+        "[-K skin] "
+        "[-P ratio] [-L levels] [-H] [-C] [-J iterations] [-E json] "
+        "[-T trace] [-W steps] [-B runs] [-b backends] [-G chunks] "
+        "[-U cache]\n", prog);
+}
+
+static int lattice_side(void) {
+    int side = 1;
+    while (side * side * side < sim.n_balls) {
+        side++;
     }
+    return side;
+}
+
+static void alloc_vecs(struct vecs *v) {
+    size_t size = 3 * sim.stride * sizeof(float);
+    v->x = xaligned_alloc(SIMD_ALIGN, size);
+    v->y = v->x + sim.stride;
+    v->z = v->y + sim.stride;
 }
 
-void init_velocities(void) {
-    for (int i = 0; i < N_BALLS; i++) {
-        sim.v[i].x = 2.0 * drand48() - 1.0;
-        sim.v[i].y = 2.0 * drand48() - 1.0;
-        sim.v[i].z = 2.0 * drand48() - 1.0;
+/* 
+ * use up to sim.n_levels levels but stop once the smallest balls do not
+ * fit the cells of the next one, the balls of a level can meet those of
+ * the same or coarser levels in the 3x3x3 cells around them, which takes
+ * 27 passes per pair of levels or 8 within a level with -C
+ */
+static void init_levels(void) {
+    float min_size = 2.0f * sim.radius / sim.ratio + sim.skin;
+    int l = 0;
+    long start = 0;
+    do {
+        long len = (long) sim.grid_len << l;
+        if (len > 1 << MAX_KEY_BITS) {
+            die("grid length %d too large\n", sim.grid_len);
+        }
+        sim.level_len[l] = len;
+        sim.level_start[l] = start;
+        start += sim.hashed ? 0 : len * len * len;
+        if (start >= INT_MAX) {
+            die("grid length %d too large without -H\n", sim.grid_len);
+        }
+        l++;
+    } while (l < sim.n_levels && min_size * (1 << l) <= 1.0f);
+    sim.n_levels = l;
+    sim.level_start[l] = start;
+    sim.n_passes = (sim.checkerboard ? 8 : 27) * l + 27 * l * (l - 1) / 2;
+    while (1 << sim.key_bits < sim.level_len[l - 1]) {
+        sim.key_bits++;
     }
 }
 
-void init_grid(void) {
-    memset(sim.grid, 0xFF, sizeof(sim.grid));
-    for (int i = 0; i < N_BALLS; i++) {
-        int x = sim.x[i].x + GRID_LEN / 2;
-        int y = sim.x[i].y + GRID_LEN / 2;
-        int z = sim.x[i].z + GRID_LEN / 2;
-        sim.nodes[i] = sim.grid[x][y][z];
-        sim.grid[x][y][z] = i;
+#define RADIX_BITS 11
+#define RADIX_MASK ((1 << RADIX_BITS) - 1)
+
+static int *part_sums;
+static int *digit_counts;
+static uint64_t *ball_keys;
+static uint64_t *radix_keys;
+static ball_idx *radix_balls;
+
+static void alloc_hash(void) {
+    sim.hash_bits = 1;
+    while (1 << sim.hash_bits < 2 * sim.n_balls) {
+        sim.hash_bits++;
     }
+    sim.rows = xmalloc((1 << sim.hash_bits) * sizeof(*sim.rows));
+    sim.cell_keys = xmalloc(sim.n_balls * sizeof(*sim.cell_keys));
+    ball_keys = xmalloc(sim.n_balls * sizeof(*ball_keys));
+    radix_keys = xmalloc(sim.n_balls * sizeof(*radix_keys));
+    radix_balls = xmalloc(sim.n_balls * sizeof(*radix_balls));
 }
 
-void resolve_collisions(void) {
-    for (int i = 0; i < 27; i++) {
-        int dx = i % 3 - 1;
-        int dy = i / 3 % 3 - 1;
-        int dz = i / 9 - 1;
-        sim.ix = dx && !dy && !dz ? 2 : 1;
-        sim.iy = dy && !dz ? 2 : 1;
-        sim.iz = dz ? 2 : 1;
-        int nd = abs(dx) + abs(dy) + abs(dz);
-        sim.tx = abs(dx);
-        sim.ty = abs(dy);
-        sim.tz = abs(dz);
-        switch (nd) {
-        case 0:
-        case 1:
-            sim.px = dx < 0;
-            sim.py = dy < 0;
-            sim.nx = dx < 0;
-            sim.ny = dy < 0;
-            break;
-        case 2:
-            if (!dx) {
-                sim.ty = dy / dz;
-                sim.px = 0;
-                sim.py = sim.ty < 0;
-                sim.nx = 0;
-                sim.ny = sim.ty > 0;
-            } else if (!dy) {
-                sim.tx = dx / dz;
-                sim.px = sim.tx < 0;
-                sim.py = 0;
-                sim.nx = sim.tx > 0;
-                sim.ny = 0;
-            } else {
-                sim.tx = dx / dy;
-                sim.px = sim.tx < 0;
-                sim.py = dy < 0;
-                sim.nx = sim.tx > 0;
-                sim.ny = dy < 0;
+static void alloc_sim(void) {
+    int n_cells = sim.hashed ? sim.n_balls : sim.level_start[sim.n_levels];
+    int lanes = SIMD_ALIGN / sizeof(float);
+    sim.stride = (sim.n_balls + lanes - 1) / lanes * lanes;
+    alloc_vecs(&sim.x);
+    alloc_vecs(&sim.v);
+    alloc_vecs(&sim.x0);
+    sim.r = xaligned_alloc(SIMD_ALIGN, sim.stride * sizeof(*sim.r));
+    sim.w = xaligned_alloc(SIMD_ALIGN, sim.stride * sizeof(*sim.w));
+    sim.ids = xmalloc(sim.n_balls * sizeof(*sim.ids));
+    sim.ball_cells = xmalloc(sim.n_balls * sizeof(*sim.ball_cells));
+    sim.sorted = xmalloc(sim.n_balls * sizeof(*sim.sorted));
+    sim.cell_start = xmalloc((n_cells + 1) * sizeof(*sim.cell_start));
+    sim.cell_balls = sim.sorted;
+    /* no backend splits the grid into more parts than there are workers */
+    part_sums = xmalloc(sim.n_workers * sizeof(*part_sums));
+    digit_counts = xmalloc((sim.n_workers << RADIX_BITS) * 
+                           sizeof(*digit_counts));
+    if (sim.hashed) {
+        alloc_hash();
+    }
+    if (sim.reorder || sim.morton_steps) {
+        alloc_vecs(&sim.xs);
+    }
+    if (sim.skin > 0.0f) {
+        alloc_vecs(&sim.xb);
+    }
+    if (sim.jacobi) {
+        alloc_vecs(&sim.xn);
+    }
+    if (sim.reorder) {
+        sim.iota = xmalloc(sim.n_balls * sizeof(*sim.iota));
+        sim.cell_balls = sim.iota;
+    }
+}
+
+/* 
+ * radii are log-uniform between sim.radius / sim.ratio and sim.radius, 
+ * masses grow with the volume and w holds their inverse relative to a 
+ * ball of sim.radius
+ */
+static void init_radii(void) {
+    for (int i = 0; i < sim.n_balls; i++) {
+        float r = sim.radius;
+        if (sim.ratio > 1.0f) {
+            r *= powf(sim.ratio, -drand48());
+        }
+        float s = sim.radius / r;
+        sim.r[i] = r;
+        sim.w[i] = s * s * s;
+    }
+}
+
+static const struct backend *find_backend(const char *name) {
+    int n = sizeof(linked_backends) / sizeof(*linked_backends);
+    for (int i = 0; i < n; i++) {
+        if (linked_backends[i] && !strcmp(linked_backends[i]->name, name)) {
+            return linked_backends[i];
+        }
+    }
+    die("backend %s is unknown or not built into this program\n", name);
+    return NULL;
+}
+
+/* a comma separated list of backends */
+static void add_backends(char *names) {
+    for (char *s = strtok(names, ","); s; s = strtok(NULL, ",")) {
+        if (sim.n_backends == MAX_BACKENDS) {
+            die("at most %d backends\n", MAX_BACKENDS);
+        }
+        const struct backend *b = find_backend(s);
+        for (int k = 0; k < sim.n_backends; k++) {
+            if (sim.backends[k] == b) {
+                die("backend %s given twice\n", s);
             }
+        }
+        sim.backends[sim.n_backends++] = b;
+    }
+}
+
+static void init_params(int argc, char **argv) {
+    int n_seconds = N_SECONDS;
+    sim.n_balls = N_BALLS;
+    sim.radius = RADIUS;
+    sim.sps = SPS;
+    sim.ratio = 1.0f;
+    sim.n_levels = 1;
+    sim.n_parts = 1;
+    sim.runs = 1;
+    sim.chunks = CHUNKS_PER_WORKER;
+    tunable = TUNE_WORKERS | TUNE_LEVELS | TUNE_CHUNKS;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:g:r:s:t:w:A:N:RM:K:P:L:HCJ:E:T:W:B:b:G:U:")) != -1) {
+        switch (opt) {
+        case 'n':
+            sim.n_balls = atoi(optarg);
+            break;
+        case 'g':
+            sim.grid_len = atoi(optarg);
+            break;
+        case 'r':
+            sim.radius = atof(optarg);
+            break;
+        case 's':
+            sim.sps = atoi(optarg);
+            break;
+        case 't':
+            n_seconds = atoi(optarg);
+            break;
+        case 'w':
+            sim.n_workers = atoi(optarg);
+            tunable &= ~TUNE_WORKERS;
+            break;
+        case 'A':
+            sim.affinity = optarg;
+            break;
+        case 'N':
+            sim.narrow = optarg;
+            break;
+        case 'R':
+            sim.reorder = 1;
+            break;
+        case 'M':
+            sim.morton_steps = atoi(optarg);
+            break;
+        case 'K':
+            sim.skin = atof(optarg);
+            break;
+        case 'P':
+            sim.ratio = atof(optarg);
+            break;
+        case 'L':
+            sim.n_levels = atoi(optarg);
+            tunable &= ~TUNE_LEVELS;
+            break;
+        case 'H':
+            sim.hashed = 1;
+            break;
+        case 'C':
+            sim.checkerboard = 1;
+            break;
+        case 'J':
+            sim.jacobi = atoi(optarg);
+            break;
+        case 'E':
+            sim.counters = optarg;
+            break;
+        case 'T':
+            sim.trace = optarg;
+            break;
+        case 'W':
+            sim.warmup = atoi(optarg);
+            break;
+        case 'B':
+            sim.runs = atoi(optarg);
+            break;
+        case 'b':
+            add_backends(optarg);
+            break;
+        case 'G':
+            sim.chunks = atoi(optarg);
+            tunable &= ~TUNE_CHUNKS;
+            break;
+        case 'U':
+            sim.tune = optarg;
             break;
         default:
-            sim.tx = dx / dz;
-            sim.ty = dy / dz;
-            sim.px = sim.tx < 0;
-            sim.py = sim.ty < 0;
-            sim.nx = sim.tx > 0;
-            sim.ny = sim.ty > 0;
-        }
-        sim.pz = dz < 0;
-        sim.nz = dz < 0;
+            usage(argv[0]);
+        }
+    }
+    if (sim.n_balls <= 0 || sim.sps <= 0 || n_seconds < 0 || 
+        sim.morton_steps < 0 || !(sim.ratio >= 1.0f) || sim.jacobi < 0 || 
+        sim.warmup < 0 || sim.runs < 1 || sim.chunks < 1 || 
+        sim.n_levels < 1 || sim.n_levels > MAX_LEVELS) {
+        usage(argv[0]);
+    }
+    if (!sim.n_backends && sim.default_backend) {
+        sim.backends[sim.n_backends++] = find_backend(sim.default_backend);
+    }
+    int n_linked = sizeof(linked_backends) / sizeof(*linked_backends);
+    for (int i = 0; i < n_linked && !sim.n_backends; i++) {
+        if (linked_backends[i]) {
+            sim.backends[sim.n_backends++] = linked_backends[i];
+        }
+    }
+    if (sim.n_workers <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        sim.n_workers = n > 0 ? n : 1;
+    }
+    if (sim.n_balls > MAX_BALLS) {
+        die("at most %d balls supported with %d-bit indices\n", 
+            MAX_BALLS, IDX_BITS);
+    }
+    int side = lattice_side();
+    if (!sim.grid_len) {
+        sim.grid_len = 2 * side;
+    }
+    if (sim.grid_len <= side) {
+        die("grid length %d too small for %d balls\n", 
+            sim.grid_len, sim.n_balls);
+    }
+    if (sim.radius <= 0.0f || sim.radius > 0.5f) {
+        die("radius must be in (0, 0.5]\n");
+    }
+    sim.diameter = 2.0f * sim.radius;
+    if (sim.skin < 0.0f || sim.diameter + sim.skin > 1.0f) {
+        die("diameter plus skin must fit in a cell\n");
+    }
+    if (sim.skin > 0.0f && sim.reorder) {
+        die("-R cannot be combined with -K\n");
+    }
+    if (sim.ratio > 1.0f && sim.reorder) {
+        die("-R cannot be combined with -P\n");
+    }
+    if (sim.checkerboard && sim.hashed) {
+        die("-C cannot be combined with -H\n");
+    }
+    if (sim.jacobi && (sim.skin > 0.0f || sim.checkerboard)) {
+        die("-J cannot be combined with -K or -C\n");
+    }
+    sim.dt = 1.0f / sim.sps;
+    sim.n_steps = n_seconds * sim.sps;
+}
+
+/* 
+ * the ball data is first touched and the grid built in sim.n_parts parts,
+ * parallel_grid_work runs a function on every part, concurrently if the 
+ * backend has workers
+ */
+static int part_start(int part, int n) {
+    return (long) part * n / sim.n_parts;
+}
+
+/* 
+ * the first write to a page places it on the NUMA node of the writer, so 
+ * each part clears the balls and cells it works on first
+ */
+static void touch_vecs(struct vecs *v, int part) {
+    if (!v->x) {
+        return;
+    }
+    int k0 = part_start(part, sim.n_balls);
+    int k1 = part + 1 == sim.n_parts ? sim.stride : 
+             part_start(part + 1, sim.n_balls);
+    memset(v->x + k0, 0, (k1 - k0) * sizeof(float));
+    memset(v->y + k0, 0, (k1 - k0) * sizeof(float));
+    memset(v->z + k0, 0, (k1 - k0) * sizeof(float));
+}
+
+static void first_touch_part(int part) {
+    touch_vecs(&sim.x, part);
+    touch_vecs(&sim.v, part);
+    touch_vecs(&sim.x0, part);
+    touch_vecs(&sim.xs, part);
+    touch_vecs(&sim.xb, part);
+    touch_vecs(&sim.xn, part);
+    int k1 = part_start(part + 1, sim.n_balls);
+    for (int k = part_start(part, sim.n_balls); k < k1; k++) {
+        sim.r[k] = 0.0f;
+        sim.w[k] = 0.0f;
+        sim.ids[k] = k;
+        sim.ball_cells[k] = 0;
+        sim.sorted[k] = 0;
+        if (sim.iota) {
+            sim.iota[k] = k;
+        }
+    }
+    int n_cells = sim.hashed ? sim.n_balls : sim.level_start[sim.n_levels];
+    int c0 = part_start(part, n_cells + 1);
+    int c1 = part_start(part + 1, n_cells + 1);
+    memset(sim.cell_start + c0, 0, (c1 - c0) * sizeof(*sim.cell_start));
+}
+
+static void init_positions(void) {
+    parallel_grid_work(first_touch_part);
+    init_radii();
+    int side = lattice_side();
+    for (int i = 0; i < sim.n_balls; i++) {
+        sim.x.x[i] = i % side - side / 2 + 0.5f;
+        sim.x.y[i] = i / side % side - side / 2 + 0.5f;
+        sim.x.z[i] = i / (side * side) - side / 2 + 0.5f;
+    }
+}
+
+static void init_velocities(void) {
+    for (int i = 0; i < sim.n_balls; i++) {
+        sim.v.x[i] = 2.0 * drand48() - 1.0;
+        sim.v.y[i] = 2.0 * drand48() - 1.0;
+        sim.v.z[i] = 2.0 * drand48() - 1.0;
+    }
+}
+
+static int ball_cell(int i) {
+    int l = ball_level(i);
+    int x = level_coord(sim.x.x[i], l);
+    int y = level_coord(sim.x.y[i], l);
+    int z = level_coord(sim.x.z[i], l);
+    return cell_idx(l, x, y, z);
+}
+
+static void swap_vecs(struct vecs *a, struct vecs *b) {
+    struct vecs t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static void sort_positions_part(int part) {
+    int k1 = part_start(part + 1, sim.n_balls);
+    for (int k = part_start(part, sim.n_balls); k < k1; k++) {
+        int i = sim.sorted[k];
+        sim.xs.x[k] = sim.x.x[i];
+        sim.xs.y[k] = sim.x.y[i];
+        sim.xs.z[k] = sim.x.z[i];
+    }
+}
+
+static uint64_t ball_key(int i) {
+    int l = ball_level(i);
+    int x = level_coord(sim.x.x[i], l);
+    int y = level_coord(sim.x.y[i], l);
+    int z = level_coord(sim.x.z[i], l);
+    return cell_key(l, x, y, z);
+}
+
+static int radix_shift;
+static uint64_t *from_keys;
+static uint64_t *to_keys;
+static ball_idx *from_balls;
+static ball_idx *to_balls;
+
+static void key_balls_part(int part) {
+    int i1 = part_start(part + 1, sim.n_balls);
+    for (int i = part_start(part, sim.n_balls); i < i1; i++) {
+        ball_keys[i] = ball_key(i);
+        sim.sorted[i] = i;
+    }
+}
+
+static void count_digits_part(int part) {
+    int *counts = digit_counts + (part << RADIX_BITS);
+    memset(counts, 0, sizeof(*counts) << RADIX_BITS);
+    int k1 = part_start(part + 1, sim.n_balls);
+    for (int k = part_start(part, sim.n_balls); k < k1; k++) {
+        counts[from_keys[k] >> radix_shift & RADIX_MASK]++;
+    }
+}
+
+static void scatter_digits_part(int part) {
+    int *counts = digit_counts + (part << RADIX_BITS);
+    int k1 = part_start(part + 1, sim.n_balls);
+    for (int k = part_start(part, sim.n_balls); k < k1; k++) {
+        int m = counts[from_keys[k] >> radix_shift & RADIX_MASK]++;
+        to_keys[m] = from_keys[k];
+        to_balls[m] = from_balls[k];
+    }
+}
+
+/* 
+ * stable LSD radix sort of the balls by key into sim.sorted, each part 
+ * counts the digits of its balls and scatters them behind the balls with 
+ * the same digit of the parts before it
+ */
+static void radix_sort_balls(void) {
+    int n_bits = 3 * sim.key_bits + (sim.n_levels > 1 ? 2 : 0);
+    parallel_grid_work(key_balls_part);
+    from_keys = ball_keys;
+    from_balls = sim.sorted;
+    to_keys = radix_keys;
+    to_balls = radix_balls;
+    for (radix_shift = 0; radix_shift < n_bits; radix_shift += RADIX_BITS) {
+        parallel_grid_work(count_digits_part);
+        int sum = 0;
+        for (int d = 0; d <= RADIX_MASK; d++) {
+            for (int part = 0; part < sim.n_parts; part++) {
+                int *count = &digit_counts[(part << RADIX_BITS) + d];
+                int n = *count;
+                *count = sum;
+                sum += n;
+            }
+        }
+        parallel_grid_work(scatter_digits_part);
+        uint64_t *keys = from_keys;
+        ball_idx *balls = from_balls;
+        from_keys = to_keys;
+        from_balls = to_balls;
+        to_keys = keys;
+        to_balls = balls;
+    }
+    if (from_balls != sim.sorted) {
+        memcpy(sim.sorted, from_balls, sim.n_balls * sizeof(*sim.sorted));
+        memcpy(ball_keys, from_keys, sim.n_balls * sizeof(*ball_keys));
+    }
+}
+
+static struct row_slot *add_row(uint64_t row, int c) {
+    int mask = (1 << sim.hash_bits) - 1;
+    int s = hash_slot(row);
+    while (sim.rows[s].key != EMPTY_KEY) {
+        s = (s + 1) & mask;
+    }
+    sim.rows[s] = (struct row_slot) {row, c, c};
+    return &sim.rows[s];
+}
+
+/* 
+ * sort the balls by key and split them into cells at every new key, the
+ * rows are added to the table as they start
+ */
+static void sort_hashed_balls(void) {
+    radix_sort_balls();
+    memset(sim.rows, 0xFF, (1 << sim.hash_bits) * sizeof(*sim.rows));
+    struct row_slot *row = NULL;
+    int l = 0;
+    int c = 0;
+    for (int k = 0; k < sim.n_balls; k++) {
+        uint64_t key = ball_keys[k];
+        if (k && key == ball_keys[k - 1]) {
+            continue;
+        }
+        for (; l <= (int) (key >> 3 * sim.key_bits); l++) {
+            sim.level_start[l] = c;
+        }
+        if (!row || key >> sim.key_bits != row->key) {
+            row = add_row(key >> sim.key_bits, c);
+        }
+        row->end = c + 1;
+        sim.cell_keys[c] = key;
+        sim.cell_start[c++] = k;
+    }
+    for (; l <= sim.n_levels; l++) {
+        sim.level_start[l] = c;
+    }
+    sim.cell_start[c] = sim.n_balls;
+}
+
+static void clear_cells_part(int part) {
+    int n_cells = sim.level_start[sim.n_levels];
+    int c0 = part_start(part, n_cells);
+    int c1 = part_start(part + 1, n_cells);
+    memset(sim.cell_start + c0, 0, (c1 - c0) * sizeof(*sim.cell_start));
+}
+
+static void count_balls_part(int part) {
+    int i1 = part_start(part + 1, sim.n_balls);
+    for (int i = part_start(part, sim.n_balls); i < i1; i++) {
+        int c = ball_cell(i);
+        sim.ball_cells[i] = c;
+        if (sim.n_parts == 1) {
+            sim.cell_start[c]++;
+        } else {
+            __atomic_fetch_add(&sim.cell_start[c], 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void sum_cells_part(int part) {
+    int n_cells = sim.level_start[sim.n_levels];
+    int c1 = part_start(part + 1, n_cells);
+    int sum = 0;
+    for (int c = part_start(part, n_cells); c < c1; c++) {
+        sum += sim.cell_start[c];
+        sim.cell_start[c] = sum;
+    }
+    part_sums[part] = sum;
+}
+
+static void offset_cells_part(int part) {
+    int n_cells = sim.level_start[sim.n_levels];
+    int c1 = part_start(part + 1, n_cells);
+    int offset = 0;
+    for (int p = 0; p < part; p++) {
+        offset += part_sums[p];
+    }
+    for (int c = part_start(part, n_cells); c < c1; c++) {
+        sim.cell_start[c] += offset;
+    }
+}
+
+static void scatter_balls_part(int part) {
+    int i0 = part_start(part, sim.n_balls);
+    for (int i = part_start(part + 1, sim.n_balls) - 1; i >= i0; i--) {
+        ball_idx *start = &sim.cell_start[sim.ball_cells[i]];
+        int k;
+        if (sim.n_parts == 1) {
+            k = --*start;
+        } else {
+            k = __atomic_sub_fetch(start, 1, __ATOMIC_RELAXED);
+        }
+        sim.sorted[k] = i;
+    }
+}
+
+/* parts scatter in any order, put the balls of each cell back in order */
+static void order_cells_part(int part) {
+    int n_cells = sim.level_start[sim.n_levels];
+    int c1 = part_start(part + 1, n_cells);
+    for (int c = part_start(part, n_cells); c < c1; c++) {
+        int k1 = sim.cell_start[c + 1];
+        for (int k = sim.cell_start[c] + 1; k < k1; k++) {
+            ball_idx i = sim.sorted[k];
+            int m = k;
+            for (; m > sim.cell_start[c] && sim.sorted[m - 1] > i; m--) {
+                sim.sorted[m] = sim.sorted[m - 1];
+            }
+            sim.sorted[m] = i;
+        }
+    }
+}
+
+/* 
+ * counting sort of the balls by the index of their cell, the parts count
+ * and scatter with atomics and sum their cells before the cells of the
+ * parts after them are offset
+ */
+static void sort_balls(void) {
+    int n_cells = sim.level_start[sim.n_levels];
+    parallel_grid_work(clear_cells_part);
+    parallel_grid_work(count_balls_part);
+    parallel_grid_work(sum_cells_part);
+    if (sim.n_parts > 1) {
+        parallel_grid_work(offset_cells_part);
+    }
+    sim.cell_start[n_cells] = sim.n_balls;
+    parallel_grid_work(scatter_balls_part);
+    if (sim.n_parts > 1) {
+        parallel_grid_work(order_cells_part);
+    }
+}
+
+/* 
+ * sort the balls by cell, the balls of cell c are cell_balls[cell_start[c]]
+ * up to cell_balls[cell_start[c + 1]]
+ */
+void init_grid(void) {
+    if (sim.hashed) {
+        sort_hashed_balls();
+    } else {
+        sort_balls();
+    }
+    if (sim.reorder) {
+        parallel_grid_work(sort_positions_part);
+        swap_vecs(&sim.x, &sim.xs);
+    }
+}
+
+static void restore_positions_part(int part) {
+    int k1 = part_start(part + 1, sim.n_balls);
+    for (int k = part_start(part, sim.n_balls); k < k1; k++) {
+        int i = sim.sorted[k];
+        sim.xs.x[i] = sim.x.x[k];
+        sim.xs.y[i] = sim.x.y[k];
+        sim.xs.z[i] = sim.x.z[k];
+    }
+}
+
+/* scatter positions sorted by init_grid back to the ball order */
+void restore_positions(void) {
+    if (!sim.reorder) {
+        return;
+    }
+    parallel_grid_work(restore_positions_part);
+    swap_vecs(&sim.x, &sim.xs);
+}
+
+/* with -C a pass takes one of 8 colours of blocks of cells instead */
+static void resolve_level_collisions(void) {
+    if (sim.checkerboard) {
+        for (int i = 0; i < 8; i++) {
+            sim.colour = i;
+            resolve_pair_collisions();
+            sim.pass++;
+        }
+        return;
+    }
+    for (int i = 0; i < 27; i++) {
+        sim.stencil = pass_stencil(i);
         resolve_pair_collisions();
+        sim.pass++;
+    }
+}
+
+/* 
+ * sim.pass counts the passes of a step, a pass between two levels pairs 
+ * every coarse cell with the fine cells under its neighbour sim.neighbour
+ */
+void resolve_collisions(void) {
+    sim.pass = 0;
+    for (int l = 0; l < sim.n_levels; l++) {
+        sim.level = l;
+        resolve_level_collisions();
+    }
+    for (int l = 1; l < sim.n_levels; l++) {
+        sim.level = l;
+        for (int c = 0; c < l; c++) {
+            sim.coarse = c;
+            for (int i = 0; i < 27; i++) {
+                sim.neighbour = i;
+                resolve_cross_collisions();
+                sim.pass++;
+            }
+        }
+    }
+}
+
+/* 
+ * the cells of level c around cell x of level l along one axis, coarser 
+ * cells hold the fine one and its neighbours, finer ones fill them
+ */
+static void level_span(int x, int l, int c, int *lo, int *hi) {
+    int len = sim.level_len[c];
+    if (c <= l) {
+        *lo = (x >> (l - c)) - 1;
+        *hi = (x >> (l - c)) + 2;
+    } else {
+        *lo = (x - 1) * (1 << (c - l));
+        *hi = (x + 2) * (1 << (c - l));
     }
+    *lo = *lo < 0 ? 0 : *lo;
+    *hi = *hi > len ? len : *hi;
+}
+
+/* 
+ * sum the corrections of all contacts of ball i in cell x, y, z of level 
+ * l into its next position, the lighter ball still takes the larger share 
+ * and the sum is averaged over the contacts and over-relaxed
+ */
+static void jacobi_ball(int i, int l, int x, int y, int z) {
+    float ax = 0.0f;
+    float ay = 0.0f;
+    float az = 0.0f;
+    int n = 0;
+    for (int c = 0; c < sim.n_levels; c++) {
+        int x0, x1, y0, y1, z0, z1;
+        level_span(x, l, c, &x0, &x1);
+        level_span(y, l, c, &y0, &y1);
+        level_span(z, l, c, &z0, &z1);
+        for (int rx = x0; rx < x1; rx++) {
+            for (int ry = y0; ry < y1; ry++) {
+                int j0, j1;
+                row_balls(c, rx, ry, z0, z1, &j0, &j1);
+                for (int k = j0; k < j1; k++) {
+                    int j = sim.cell_balls[k];
+                    float nx = sim.x.x[i] - sim.x.x[j];
+                    float ny = sim.x.y[i] - sim.x.y[j];
+                    float nz = sim.x.z[i] - sim.x.z[j];
+                    float d2 = nx * nx + ny * ny + nz * nz;
+                    float contact = sim.r[i] + sim.r[j];
+                    if (j != i && d2 > 0.0f && d2 < contact * contact) {
+                        float d = sqrtf(d2);
+                        float corr = (contact - d) * sim.w[i] / 
+                                     (sim.w[i] + sim.w[j]) / d;
+                        ax += nx * corr;
+                        ay += ny * corr;
+                        az += nz * corr;
+                        n++;
+                    }
+                }
+            }
+        }
+    }
+    float s = n ? JACOBI_OMEGA / n : 0.0f;
+    sim.xn.x[i] = sim.x.x[i] + ax * s;
+    sim.xn.y[i] = sim.x.y[i] + ay * s;
+    sim.xn.z[i] = sim.x.z[i] + az * s;
+}
+
+/* the cell of the k-th ball in cell order */
+static int ball_rank_cell(int k) {
+    int lo = 0;
+    int hi = sim.level_start[sim.n_levels] - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (sim.cell_start[mid + 1] <= k) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* each part takes the same number of balls in cell order */
+static void jacobi_part(int part) {
+    int k0 = part_start(part, sim.n_balls);
+    int k1 = part_start(part + 1, sim.n_balls);
+    if (k0 == k1) {
+        return;
+    }
+    int c = ball_rank_cell(k0);
+    int l = 0;
+    int k = k0;
+    while (k < k1) {
+        while (sim.cell_start[c + 1] <= k) {
+            c++;
+        }
+        while (c >= sim.level_start[l + 1]) {
+            l++;
+        }
+        int x, y, z;
+        cell_coords(c, l, &x, &y, &z);
+        int end = sim.cell_start[c + 1] < k1 ? sim.cell_start[c + 1] : k1;
+        for (; k < end; k++) {
+            jacobi_ball(sim.cell_balls[k], l, x, y, z);
+        }
+    }
+}
+
+/* 
+ * with -J every iteration reads the positions of the last one only, so 
+ * it is a single pass that the parts can run in any order
+ */
+void resolve_jacobi_collisions(void) {
+    for (int i = 0; i < sim.jacobi; i++) {
+        parallel_grid_work(jacobi_part);
+        swap_vecs(&sim.x, &sim.xn);
+    }
+}
+
+/* spread the low 21 bits of v so there are two zero bits between each */
+static uint64_t spread_bits(uint64_t v) {
+    v &= 0x1FFFFF;
+    v = (v | v << 32) & 0x1F00000000FFFF;
+    v = (v | v << 16) & 0x1F0000FF0000FF;
+    v = (v | v << 8) & 0x100F00F00F00F00F;
+    v = (v | v << 4) & 0x10C30C30C30C30C3;
+    v = (v | v << 2) & 0x1249249249249249;
+    return v;
+}
+
+static uint64_t morton_key(int i) {
+    uint64_t x = level_coord(sim.x.x[i], 0);
+    uint64_t y = level_coord(sim.x.y[i], 0);
+    uint64_t z = level_coord(sim.x.z[i], 0);
+    return spread_bits(x) << 2 | spread_bits(y) << 1 | spread_bits(z);
+}
+
+static int key_cmp(const void *ip, const void *jp, void *arg) {
+    int i = *(int *) ip;
+    int j = *(int *) jp;
+    uint64_t *keys = arg;
+    return (keys[i] > keys[j]) - (keys[i] < keys[j]);
+}
+
+static void permute_vecs(struct vecs *v, const int *perm) {
+    for (int k = 0; k < sim.n_balls; k++) {
+        int i = perm[k];
+        sim.xs.x[k] = v->x[i];
+        sim.xs.y[k] = v->y[i];
+        sim.xs.z[k] = v->z[i];
+    }
+    swap_vecs(v, &sim.xs);
+}
+
+static void permute_floats(float *a, const int *perm) {
+    for (int k = 0; k < sim.n_balls; k++) {
+        sim.xs.x[k] = a[perm[k]];
+    }
+    memcpy(a, sim.xs.x, sim.n_balls * sizeof(*a));
+}
+
+/* 
+ * every sim.morton_steps steps move the ball data into Z-order of the grid 
+ * cells so balls close in space are close in memory, sim.ids keeps the 
+ * original index of every ball
+ */
+static int reorder_steps;
+
+void reorder_balls(void) {
+    if (!sim.morton_steps || reorder_steps++ % sim.morton_steps) {
+        return;
+    }
+    uint64_t *keys = xmalloc(sim.n_balls * sizeof(*keys));
+    int *perm = xmalloc(sim.n_balls * sizeof(*perm));
+    for (int i = 0; i < sim.n_balls; i++) {
+        keys[i] = morton_key(i);
+        perm[i] = i;
+    }
+    qsort_r(perm, sim.n_balls, sizeof(*perm), key_cmp, keys);
+    permute_vecs(&sim.x, perm);
+    permute_vecs(&sim.v, perm);
+    permute_floats(sim.r, perm);
+    permute_floats(sim.w, perm);
+    int *ids = xmalloc(sim.n_balls * sizeof(*ids));
+    for (int k = 0; k < sim.n_balls; k++) {
+        ids[k] = sim.ids[perm[k]];
+    }
+    free(sim.ids);
+    sim.ids = ids;
+    sim.nlist_valid = 0;
+    free(keys);
+    free(perm);
+}
+
+/* 
+ * neighbour lists hold every pair closer than diameter plus skin, they
+ * stay complete until some ball has moved half the skin since the build
+ */
+int nlist_expired(void) {
+    if (!sim.nlist_valid) {
+        return 1;
+    }
+    float max_d2 = 0.0f;
+    for (int i = 0; i < sim.n_balls; i++) {
+        float dx = sim.x.x[i] - sim.xb.x[i];
+        float dy = sim.x.y[i] - sim.xb.y[i];
+        float dz = sim.x.z[i] - sim.xb.z[i];
+        float d2 = dx * dx + dy * dy + dz * dz;
+        max_d2 = d2 > max_d2 ? d2 : max_d2;
+    }
+    return max_d2 > sim.skin * sim.skin / 4.0f;
+}
+
+void save_nlist_positions(void) {
+    memcpy(sim.xb.x, sim.x.x, 3 * sim.stride * sizeof(float));
+    sim.nlist_valid = 1;
+    sim.n_rebuilds++;
+}
+
+static struct vecs x_init;
+static struct vecs v_init;
+static float *r_init;
+static float *w_init;
+static int *ids_init;
+
+/* 
+ * the grid, backends and balls for the parameters in sim, every backend 
+ * is set up at once so options one does not support fail early, the 
+ * first one last as the balls are first touched in its parts, the balls 
+ * start out the same for each of them so a copy is kept if there is more 
+ * than one to compare
+ */
+void init_state(void) {
+    init_levels();
+    alloc_sim();
+    init_profile(sim.n_workers, sim.n_passes, sim.counters, sim.trace);
+    for (int k = sim.n_backends - 1; k >= 0; k--) {
+        sim.backends[k]->init();
+    }
+    sim.backend = sim.backends[0];
+    init_positions();
+    init_velocities();
+    sim.backend->load();
+    if (sim.n_backends > 1) {
+        size_t size = 3 * sim.stride * sizeof(float);
+        alloc_vecs(&x_init);
+        alloc_vecs(&v_init);
+        r_init = xmalloc(sim.n_balls * sizeof(*r_init));
+        w_init = xmalloc(sim.n_balls * sizeof(*w_init));
+        ids_init = xmalloc(sim.n_balls * sizeof(*ids_init));
+        memcpy(x_init.x, sim.x.x, size);
+        memcpy(v_init.x, sim.v.x, size);
+        memcpy(r_init, sim.r, sim.n_balls * sizeof(*r_init));
+        memcpy(w_init, sim.w, sim.n_balls * sizeof(*w_init));
+        memcpy(ids_init, sim.ids, sim.n_balls * sizeof(*ids_init));
+    }
+}
+
+/* with -U the parameters not given are tuned before anything is set up */
+void init_sim(int argc, char **argv) {
+    init_params(argc, argv);
+    if (sim.tune) {
+        autotune(sim.tune, tunable);
+    }
+    init_state();
+}
+
+/* 
+ * carry on with backend k of sim.backends from the current balls, it 
+ * rebuilds its neighbour lists
+ */
+void use_backend(int k) {
+    sim.backend->unload();
+    sim.backend = sim.backends[k];
+    sim.nlist_valid = 0;
+    sim.backend->load();
+}
+
+/* start over from the balls init_sim made, only with several backends */
+void reset_sim(void) {
+    size_t size = 3 * sim.stride * sizeof(float);
+    memcpy(sim.x.x, x_init.x, size);
+    memcpy(sim.v.x, v_init.x, size);
+    memcpy(sim.r, r_init, sim.n_balls * sizeof(*sim.r));
+    memcpy(sim.w, w_init, sim.n_balls * sizeof(*sim.w));
+    memcpy(sim.ids, ids_init, sim.n_balls * sizeof(*sim.ids));
+    reorder_steps = 0;
+    sim.nlist_valid = 0;
+    sim.n_rebuilds = 0;
+    sim.n_tests = 0;
+    reset_profile();
+    sim.backend->load();
+}
+
+void step_sim(void) {
+    sim.backend->step();
+}
+
+void print_profile(void) {
+    sim.backend->print_profile();
 }
@@ -3,30 +3,321 @@
 #define CL_TARGET_OPENCL_VERSION 300
 #define N_BALLS 4096
 #define RADIUS 0.4f
-#define DIAMETER 0.8f
 #define SPS 600
-#define DT (1.0f / SPS)
-#define N_STEPS (10 * SPS)
-#define GRID_LEN 32
-#define GRID_MIN (RADIUS - GRID_LEN / 2)
-#define GRID_MAX (GRID_LEN / 2 - RADIUS)
+#define N_SECONDS 10
+#define SIMD_ALIGN 64
+#define MAX_LEVELS 4
+#define MAX_BACKENDS 4
+#define CHUNKS_PER_WORKER 8
+#define MAX_KEY_BITS 20
+#define EMPTY_KEY UINT64_MAX
+#define JACOBI_OMEGA 1.5f
+
+#ifndef IDX_BITS
+#define IDX_BITS 32
+#endif
 
 #include <cglm/struct.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 
-struct sim {
-    vec4s x[N_BALLS];
-    vec4s v[N_BALLS];
-    vec4s x0[N_BALLS];
-    short nodes[N_BALLS];
-    short grid[GRID_LEN][GRID_LEN][GRID_LEN];
+#if IDX_BITS == 16
+typedef int16_t ball_idx;
+#define MAX_BALLS INT16_MAX
+#elif IDX_BITS == 32
+typedef int32_t ball_idx;
+#define MAX_BALLS INT32_MAX
+#else
+#error "IDX_BITS must be 16 or 32"
+#endif
+
+/* 
+ * structure of arrays, the three components of a vector live in one
+ * aligned block of 3 * sim.stride floats so they can be copied at once
+ */
+struct vecs {
+    float *x;
+    float *y;
+    float *z;
+};
+
+/* 
+ * a pass pairs every tile with its neighbour tx, ty, tz, the tiles start 
+ * px, py, pz cells in and stop nx, ny, nz cells short of the far side with 
+ * ix, iy, iz cells between them
+ */
+struct stencil {
     short tx, ty, tz;
     short px, py, pz;
     short nx, ny, nz;
     short ix, iy, iz;
 };
 
+/* 
+ * a simulation engine, init sets it up once before the balls exist, load 
+ * hands it the balls and unload takes them back before another engine 
+ * runs, the grid code of sim.c calls back into it for the passes
+ */
+struct backend {
+    const char *name;
+    void (*init)(void);
+    void (*load)(void);
+    void (*unload)(void);
+    void (*step)(void);
+    void (*print_profile)(void);
+    void (*resolve_pair_collisions)(void);
+    void (*resolve_cross_collisions)(void);
+    void (*parallel_grid_work)(void(*work)(int));
+};
+
+struct row_slot {
+    uint64_t key;
+    int first;
+    int end;
+};
+
+struct sim {
+    int n_balls;
+    int grid_len;
+    int sps;
+    int n_steps;
+    int warmup;
+    int runs;
+    float radius;
+    float diameter;
+    float ratio;
+    float dt;
+    int n_levels;
+    int n_passes;
+    int hashed;
+    int checkerboard;
+    int jacobi;
+    int level_len[MAX_LEVELS];
+    int level_start[MAX_LEVELS + 1];
+    int n_workers;
+    int n_parts;
+    int chunks;
+    const char *tune;
+    const struct backend *backend;
+    const struct backend *backends[MAX_BACKENDS];
+    int n_backends;
+    const char *default_backend;
+    const char *narrow;
+    const char *affinity;
+    const char *counters;
+    const char *trace;
+    int reorder;
+    int morton_steps;
+    float skin;
+    int nlist_valid;
+    int n_rebuilds;
+    long n_tests;
+    int stride;
+    struct vecs x;
+    struct vecs v;
+    struct vecs x0;
+    struct vecs xs;
+    struct vecs xb;
+    struct vecs xn;
+    float *r;
+    float *w;
+    int *ids;
+    int *ball_cells;
+    ball_idx *sorted;
+    ball_idx *iota;
+    ball_idx *cell_start;
+    ball_idx *cell_balls;
+    uint64_t *cell_keys;
+    struct row_slot *rows;
+    int key_bits;
+    int hash_bits;
+    struct stencil stencil;
+    int colour;
+    int neighbour;
+    int pass;
+    int level;
+    int coarse;
+};
+
 extern struct sim sim;
 
+/* 
+ * the grid has sim.n_levels levels, the cells of level l are 1 / 2^l wide 
+ * and hold the balls that fit them but not the cells of level l + 1
+ */
+static inline int cell_idx(int l, int x, int y, int z) {
+    int len = sim.level_len[l];
+    return sim.level_start[l] + (x * len + y) * len + z;
+}
+
+/* 
+ * with sim.hashed only occupied cells exist, they are numbered in the 
+ * order of their keys like the cells of the dense grid and an open 
+ * addressing table maps each occupied row along z to its cells
+ */
+static inline uint64_t cell_key(int l, int x, int y, int z) {
+    int b = sim.key_bits;
+    return (uint64_t) l << 3 * b | (uint64_t) x << 2 * b | 
+           (uint64_t) y << b | z;
+}
+
+static inline int hash_slot(uint64_t row) {
+    return row * 0x9E3779B97F4A7C15u >> (64 - sim.hash_bits);
+}
+
+static inline const struct row_slot *find_row(uint64_t row) {
+    int mask = (1 << sim.hash_bits) - 1;
+    for (int s = hash_slot(row); ; s = (s + 1) & mask) {
+        if (sim.rows[s].key == row) {
+            return &sim.rows[s];
+        }
+        if (sim.rows[s].key == EMPTY_KEY) {
+            return NULL;
+        }
+    }
+}
+
+/* the first cell of the row whose key is not below key */
+static inline int lower_cell(const struct row_slot *r, uint64_t key) {
+    int lo = r->first;
+    int hi = r->end;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (sim.cell_keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* the occupied cell with the key or -1 */
+static inline int find_cell(uint64_t key) {
+    const struct row_slot *r = find_row(key >> sim.key_bits);
+    if (!r) {
+        return -1;
+    }
+    int c = lower_cell(r, key);
+    return c < r->end && sim.cell_keys[c] == key ? c : -1;
+}
+
+static inline void cell_coords(int c, int l, int *x, int *y, int *z) {
+    if (sim.hashed) {
+        int b = sim.key_bits;
+        uint64_t key = sim.cell_keys[c];
+        uint64_t mask = ((uint64_t) 1 << b) - 1;
+        *x = key >> 2 * b & mask;
+        *y = key >> b & mask;
+        *z = key & mask;
+    } else {
+        int len = sim.level_len[l];
+        c -= sim.level_start[l];
+        *x = c / len / len;
+        *y = c / len % len;
+        *z = c % len;
+    }
+}
+
+/* 
+ * balls of cells z0 up to z1 - 1 in row x, y of level l, the cells of a 
+ * row follow each other in both grids so their balls do too
+ */
+static inline void row_balls(int l, int x, int y, int z0, int z1, 
+                             int *j0, int *j1) {
+    if (!sim.hashed) {
+        *j0 = sim.cell_start[cell_idx(l, x, y, z0)];
+        *j1 = sim.cell_start[cell_idx(l, x, y, z1 - 1) + 1];
+        return;
+    }
+    const struct row_slot *r = find_row(cell_key(l, x, y, 0) >> sim.key_bits);
+    if (!r) {
+        *j0 = *j1 = 0;
+        return;
+    }
+    *j0 = sim.cell_start[lower_cell(r, cell_key(l, x, y, z0))];
+    *j1 = sim.cell_start[lower_cell(r, cell_key(l, x, y, z1))];
+}
+
+static inline int level_coord(float x, int l) {
+    return (x + sim.grid_len / 2) * (1 << l);
+}
+
+static inline int ball_level(int i) {
+    float size = 2.0f * sim.r[i] + sim.skin;
+    int l = 0;
+    while (l + 1 < sim.n_levels && size * (2 << l) <= 1.0f) {
+        l++;
+    }
+    return l;
+}
+
+/* 
+ * the stencil of pass i of the 27 passes over a level, the self pass and 
+ * two colours of each of the 13 directions of the half shell, with a 
+ * constant i it folds to constants
+ */
+static inline struct stencil pass_stencil(int i) {
+    struct stencil s;
+    int dx = i % 3 - 1;
+    int dy = i / 3 % 3 - 1;
+    int dz = i / 9 - 1;
+    s.ix = dx && !dy && !dz ? 2 : 1;
+    s.iy = dy && !dz ? 2 : 1;
+    s.iz = dz ? 2 : 1;
+    int nd = abs(dx) + abs(dy) + abs(dz);
+    s.tx = abs(dx);
+    s.ty = abs(dy);
+    s.tz = abs(dz);
+    switch (nd) {
+    case 0:
+    case 1:
+        s.px = dx < 0;
+        s.py = dy < 0;
+        s.nx = dx < 0;
+        s.ny = dy < 0;
+        break;
+    case 2:
+        if (!dx) {
+            s.ty = dy / dz;
+            s.px = 0;
+            s.py = s.ty < 0;
+            s.nx = 0;
+            s.ny = s.ty > 0;
+        } else if (!dy) {
+            s.tx = dx / dz;
+            s.px = s.tx < 0;
+            s.py = 0;
+            s.nx = s.tx > 0;
+            s.ny = 0;
+        } else {
+            s.tx = dx / dy;
+            s.px = s.tx < 0;
+            s.py = dy < 0;
+            s.nx = s.tx > 0;
+            s.ny = dy < 0;
+        }
+        break;
+    default:
+        s.tx = dx / dz;
+        s.ty = dy / dz;
+        s.px = s.tx < 0;
+        s.py = s.ty < 0;
+        s.nx = s.tx > 0;
+        s.ny = s.ty > 0;
+    }
+    s.pz = dz < 0;
+    s.nz = dz < 0;
+    return s;
+}
+
+static inline vec3s get_vec(const struct vecs *v, int i) {
+    return (vec3s) {{v->x[i], v->y[i], v->z[i]}};
+}
+
 void init_sim(int argc, char **argv);
+void use_backend(int k);
+void reset_sim(void);
 void step_sim(void);
 void print_profile(void);
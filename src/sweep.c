@@ -0,0 +1,237 @@
+#include "misc.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MAX_VALUES 64
+#define MAX_ARGS 64
+
+struct list {
+    const char *values[MAX_VALUES];
+    int nums[MAX_VALUES];
+    int n;
+};
+
+/* what a bench reports, with the workers and grid length it really used */
+struct result {
+    int workers;
+    int grid;
+    double median;
+    double min;
+    double stddev;
+    int runs;
+};
+
+static void usage(const char *prog) {
+    die("usage: %s [-b backends] [-n balls] [-w workers] [-g grid lengths] "
+        "[-t seconds] [-W warmup steps] [-B runs] [-f csv|json] "
+        "[-- bench options]\n", prog);
+}
+
+/* 
+ * split a comma separated list in place, the values of a numeric list 
+ * must be non-negative integers and are parsed into nums
+ */
+static void split_list(struct list *l, char *s, int numeric) {
+    l->n = 0;
+    for (char *v = strtok(s, ","); v; v = strtok(NULL, ",")) {
+        if (l->n == MAX_VALUES) {
+            die("at most %d values per list\n", MAX_VALUES);
+        }
+        if (numeric) {
+            char *end;
+            long x = strtol(v, &end, 10);
+            if (end == v || *end || x < 0 || x > INT_MAX) {
+                die("not a non-negative integer: %s\n", v);
+            }
+            l->nums[l->n] = x;
+        }
+        l->values[l->n++] = v;
+    }
+    if (!l->n) {
+        die("empty list\n");
+    }
+}
+
+/* 
+ * run argv with its output on a pipe and pick the steps per second from
+ * it, errors of the bench pass through on stderr, a path without a slash
+ * is looked up like the shell would
+ */
+static struct result run_bench(char **argv) {
+    int fds[2];
+    if (pipe(fds)) {
+        die("pipe failed\n");
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        die("fork failed\n");
+    }
+    if (!pid) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execvp(argv[0], argv);
+        die("cannot run %s\n", argv[0]);
+    }
+    close(fds[1]);
+    FILE *f = fdopen(fds[0], "r");
+    struct result r = {0};
+    int config = 0;
+    int rates = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        config |= sscanf(line, "workers: %d grid: %d", &r.workers, 
+                         &r.grid) == 2;
+        rates |= sscanf(line, "steps/s: median %lf min %lf stddev %lf "
+                        "runs %d", &r.median, &r.min, &r.stddev, 
+                        &r.runs) == 4;
+    }
+    fclose(f);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) || !config || !rates) {
+        die("%s failed\n", argv[0]);
+    }
+    return r;
+}
+
+static char bin_dir[256];
+static const char *seconds;
+static const char *warmup = "60";
+static const char *runs = "5";
+static char **bench_opts;
+static int n_bench_opts;
+static int json;
+static const char *sep = "";
+
+/* 
+ * run one configuration, workers is NULL for the programs without them, 
+ * the row has the workers and grid length the bench settled on
+ */
+static void run_config(const char *backend, int balls, 
+                       const char *workers, const char *grid) {
+    char path[512];
+    char balls_arg[16];
+    snprintf(balls_arg, sizeof(balls_arg), "%d", balls);
+    snprintf(path, sizeof(path), "%sbench-%s", bin_dir, backend);
+    char *args[MAX_ARGS];
+    int a = 0;
+    args[a++] = path;
+    args[a++] = "-n";
+    args[a++] = balls_arg;
+    args[a++] = "-g";
+    args[a++] = (char *) grid;
+    args[a++] = "-W";
+    args[a++] = (char *) warmup;
+    args[a++] = "-B";
+    args[a++] = (char *) runs;
+    if (workers) {
+        args[a++] = "-w";
+        args[a++] = (char *) workers;
+    }
+    if (seconds) {
+        args[a++] = "-t";
+        args[a++] = (char *) seconds;
+    }
+    for (int o = 0; o < n_bench_opts; o++) {
+        args[a++] = bench_opts[o];
+    }
+    args[a] = NULL;
+    fflush(stdout);
+    struct result r = run_bench(args);
+    if (json) {
+        printf("%s\n  {\"backend\": \"%s\", \"balls\": %d, "
+               "\"workers\": %d, \"grid\": %d, \"runs\": %d, "
+               "\"median\": %.1f, \"min\": %.1f, \"stddev\": %.1f}", 
+               sep, backend, balls, r.workers, r.grid, r.runs, r.median, 
+               r.min, r.stddev);
+        sep = ",";
+    } else {
+        printf("%s,%d,%d,%d,%d,%.1f,%.1f,%.1f\n", backend, balls, 
+               r.workers, r.grid, r.runs, r.median, r.min, r.stddev);
+    }
+}
+
+/* 
+ * every combination of backend, balls, workers and grid length is run by 
+ * its bench program in a process of its own, only bench-mt has workers, 
+ * 0 workers or grid length leave the bench default, the bench programs 
+ * are looked for next to this one
+ */
+int main(int argc, char **argv) {
+    const char *slash = strrchr(argv[0], '/');
+    snprintf(bin_dir, sizeof(bin_dir), "%.*s", 
+             slash ? (int) (slash - argv[0] + 1) : 0, argv[0]);
+    char backends[] = "mt";
+    char balls[] = "4096";
+    char workers[] = "0";
+    char grids[] = "0";
+    struct list b, n, w, g;
+    split_list(&b, backends, 0);
+    split_list(&n, balls, 1);
+    split_list(&w, workers, 1);
+    split_list(&g, grids, 1);
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:w:g:t:W:B:f:")) != -1) {
+        switch (opt) {
+        case 'b':
+            split_list(&b, optarg, 0);
+            break;
+        case 'n':
+            split_list(&n, optarg, 1);
+            break;
+        case 'w':
+            split_list(&w, optarg, 1);
+            break;
+        case 'g':
+            split_list(&g, optarg, 1);
+            break;
+        case 't':
+            seconds = optarg;
+            break;
+        case 'W':
+            warmup = optarg;
+            break;
+        case 'B':
+            runs = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "csv") && strcmp(optarg, "json")) {
+                usage(argv[0]);
+            }
+            json = !strcmp(optarg, "json");
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    bench_opts = argv + optind;
+    n_bench_opts = argc - optind;
+    if (n_bench_opts > MAX_ARGS - 16) {
+        die("too many bench options\n");
+    }
+    if (json) {
+        printf("[");
+    } else {
+        printf("backend,balls,workers,grid,runs,median,min,stddev\n");
+    }
+    for (int i = 0; i < b.n; i++) {
+        int threaded = !strcmp(b.values[i], "mt");
+        for (int j = 0; j < n.n; j++) {
+            for (int k = 0; k < (threaded ? w.n : 1); k++) {
+                for (int m = 0; m < g.n; m++) {
+                    run_config(b.values[i], n.nums[j], 
+                               threaded ? w.values[k] : NULL, g.values[m]);
+                }
+            }
+        }
+    }
+    if (json) {
+        printf("\n]\n");
+    }
+    return 0;
+}
@@ -0,0 +1,256 @@
+#include "tune.h"
+#include "sim.h"
+#include "misc.h"
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define TUNE_WARMUP 30
+#define TUNE_STEPS 100
+#define TUNE_BURSTS 3
+#define MAX_KEY 512
+
+void init_state(void);
+
+struct config {
+    int n_workers;
+    int n_levels;
+    int chunks;
+};
+
+static struct config best;
+static double best_rate;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void apply_config(const struct config *c) {
+    sim.n_workers = c->n_workers;
+    sim.n_levels = c->n_levels;
+    sim.chunks = c->chunks;
+}
+
+/* 
+ * steps of a burst until the burst has taken twice as long as it would at 
+ * the best rate so far, a losing trial need not run to the end
+ */
+static double burst(int n_steps) {
+    double limit = best_rate > 0.0 ? 2.0 * n_steps / best_rate : 0.0;
+    double t0 = now();
+    int t = 0;
+    while (t < n_steps && (!limit || now() - t0 < limit)) {
+        step_sim();
+        t++;
+    }
+    return t / (now() - t0);
+}
+
+/* 
+ * the steps per second of the best of TUNE_BURSTS bursts after a warmup, 
+ * every trial runs in a child of its own that sets the simulation up from 
+ * scratch, the parent has no threads yet so it can fork
+ */
+static double trial(const struct config *c) {
+    int fds[2];
+    if (pipe(fds)) {
+        die("pipe failed\n");
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        die("fork failed\n");
+    }
+    if (!pid) {
+        close(fds[0]);
+        apply_config(c);
+        sim.counters = NULL;
+        sim.trace = NULL;
+        init_state();
+        burst(TUNE_WARMUP);
+        double rate = 0.0;
+        for (int b = 0; b < TUNE_BURSTS; b++) {
+            double r = burst(TUNE_STEPS);
+            rate = r > rate ? r : rate;
+        }
+        if (write(fds[1], &rate, sizeof(rate)) != sizeof(rate)) {
+            _exit(EXIT_FAILURE);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    close(fds[1]);
+    double rate;
+    ssize_t n = read(fds[0], &rate, sizeof(rate));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (n != sizeof(rate) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        die("tuning trial failed\n");
+    }
+    fprintf(stderr, "tune: -w %d -L %d -G %d: %.1f steps/s\n", 
+            c->n_workers, c->n_levels, c->chunks, rate);
+    return rate;
+}
+
+/* 
+ * a config that seems faster is timed again along with the best so far, 
+ * each keeping its best rate, so a lucky trial alone cannot win
+ */
+static void try_config(struct config c) {
+    if (!memcmp(&c, &best, sizeof(c))) {
+        return;
+    }
+    double rate = trial(&c);
+    if (rate <= best_rate) {
+        return;
+    }
+    best_rate = fmax(best_rate, trial(&best));
+    rate = fmax(rate, trial(&c));
+    if (rate > best_rate) {
+        best_rate = rate;
+        best = c;
+    }
+}
+
+/* the levels init_levels would keep for the smallest balls */
+static int useful_levels(void) {
+    float min_size = 2.0f * sim.radius / sim.ratio + sim.skin;
+    int l = 1;
+    while (l < MAX_LEVELS && min_size * (1 << l) <= 1.0f) {
+        l++;
+    }
+    return l;
+}
+
+/* 
+ * one parameter after the other with the others at their best so far, 
+ * workers in powers of two up to every CPU, the grid levels the radii 
+ * allow and the chunks every worker splits a parallel loop into, which 
+ * do not matter to a single worker, the grid length is not tuned as it 
+ * sets the size of the box
+ */
+static void search(int tunable) {
+    best = (struct config) {sim.n_workers, sim.n_levels, sim.chunks};
+    best_rate = 0.0;
+    best_rate = trial(&best);
+    int threaded = !strcmp(sim.backends[0]->name, "mt");
+    int gridded = threaded || !strcmp(sim.backends[0]->name, "st");
+    if (threaded && tunable & TUNE_WORKERS) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int w = 1; w < n_cpus; w *= 2) {
+            try_config((struct config) {w, best.n_levels, best.chunks});
+        }
+        try_config((struct config) {n_cpus, best.n_levels, best.chunks});
+    }
+    if (gridded && tunable & TUNE_LEVELS) {
+        for (int l = 1; l <= useful_levels(); l++) {
+            try_config((struct config) {best.n_workers, l, best.chunks});
+        }
+    }
+    if (threaded && tunable & TUNE_CHUNKS && best.n_workers > 1) {
+        for (int c = 2; c <= 32; c *= 2) {
+            try_config((struct config) {best.n_workers, best.n_levels, c});
+        }
+    }
+}
+
+static void cpu_model(char *model, int size) {
+    snprintf(model, size, "unknown");
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (!f) {
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char *colon = strchr(line, ':');
+        if (colon && !strncmp(line, "model name", 10)) {
+            snprintf(model, size, "%s", colon + 2);
+            model[strcspn(model, "\n")] = '\0';
+            break;
+        }
+    }
+    fclose(f);
+}
+
+static void print_param(char *s, int size, int tuned, int val) {
+    if (tuned) {
+        snprintf(s, size, "?");
+    } else {
+        snprintf(s, size, "%d", val);
+    }
+}
+
+/* 
+ * the host and everything else the best parameters depend on, with ? for 
+ * the parameters being tuned
+ */
+static void tune_key(char *key, int tunable) {
+    char model[128];
+    char w[16], l[16], g[16];
+    cpu_model(model, sizeof(model));
+    print_param(w, sizeof(w), tunable & TUNE_WORKERS, sim.n_workers);
+    print_param(l, sizeof(l), tunable & TUNE_LEVELS, sim.n_levels);
+    print_param(g, sizeof(g), tunable & TUNE_CHUNKS, sim.chunks);
+    snprintf(key, MAX_KEY, "%s;%ld cpus;%s;-n %d -g %d -r %g -s %d -P %g "
+             "-K %g -R %d -M %d -H %d -C %d -J %d -N %s -A %s;-w %s -L %s "
+             "-G %s", model, sysconf(_SC_NPROCESSORS_ONLN), 
+             sim.backends[0]->name, sim.n_balls, sim.grid_len, sim.radius, 
+             sim.sps, sim.ratio, sim.skin, sim.reorder, sim.morton_steps, 
+             sim.hashed, sim.checkerboard, sim.jacobi, 
+             sim.narrow ? sim.narrow : "-", 
+             sim.affinity ? sim.affinity : "-", w, l, g);
+}
+
+/* the last entry of the cache for the key, a tab ends the key */
+static int find_cached(const char *path, const char *key, 
+                       struct config *c) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    int found = 0;
+    char line[MAX_KEY + 64];
+    size_t len = strlen(key);
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, key, len) && line[len] == '\t' && 
+            sscanf(line + len + 1, "%d %d %d", &c->n_workers, 
+                   &c->n_levels, &c->chunks) == 3) {
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+/* 
+ * pick the tunable parameters from the cache at path or by timing trial 
+ * runs and add them to the cache
+ */
+void autotune(const char *path, int tunable) {
+    char key[MAX_KEY];
+    tune_key(key, tunable);
+    struct config c;
+    if (find_cached(path, key, &c)) {
+        fprintf(stderr, "tune: cached -w %d -L %d -G %d\n", c.n_workers, 
+                c.n_levels, c.chunks);
+        apply_config(&c);
+        return;
+    }
+    search(tunable);
+    fprintf(stderr, "tune: picked -w %d -L %d -G %d\n", best.n_workers, 
+            best.n_levels, best.chunks);
+    apply_config(&best);
+    FILE *f = fopen(path, "a");
+    if (!f) {
+        die("fopen %s: %s\n", path, strerror(errno));
+    }
+    fprintf(f, "%s\t%d %d %d\n", key, best.n_workers, best.n_levels, 
+            best.chunks);
+    fclose(f);
+}
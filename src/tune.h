@@ -0,0 +1,10 @@
+#pragma once
+
+/* the parameters autotune may pick, those given on the command line stay */
+enum tunable {
+    TUNE_WORKERS = 1,
+    TUNE_LEVELS = 2,
+    TUNE_CHUNKS = 4
+};
+
+void autotune(const char *path, int tunable);
@@ -1,4 +1,5 @@
 #include <glad/gl.h>
+#include <unistd.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/opt.h>
@@ -101,8 +102,8 @@ static void create_video(const char *path) {
         die("av_frame_get_buffer: %s\n", av_err2str(ret));
     }
     glViewport(0, 0, WIDTH, HEIGHT);
-    for (int step = 0, pts = 0; step < N_STEPS; step++) {
-        if (step % (SPS / FPS) == 0) {
+    for (int step = 0, pts = 0; step < sim.n_steps; step++) {
+        if (step % (sim.sps / FPS) == 0) {
             draw();
             glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGB, 
                          GL_UNSIGNED_BYTE, pixels); 
@@ -128,15 +129,19 @@ static void create_video(const char *path) {
 
 int main(int argc, char **argv) {
     const char *path = "video.mp4";
-    if (argc == 2) {
-        path = argv[1];
-    } else if (argc > 2) {
+    sim.default_backend = "mt";
+    init_sim(argc, argv);
+    if (optind == argc - 1) {
+        path = argv[optind];
+    } else if (optind < argc - 1) {
         die("too many arguments");
     }
+    if (sim.sps < FPS) {
+        die("steps per second must be at least %d\n", FPS);
+    }
     width = WIDTH;
     height = HEIGHT;
     init_draw();
-    init_sim(argc, argv);
     create_video(path);
     return 0;
 }
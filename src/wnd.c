@@ -1,4 +1,5 @@
 #include <glad/gl.h>
+#include <stdio.h>
 #include "draw.h"
 #include "sim.h"
 
@@ -30,26 +31,45 @@ static void step_dirs(void) {
 
 static void step_eye(void) {
     if (keys[SDL_SCANCODE_W]) {
-        eye = vec3_muladds(front, 20.0f * DT, eye);
+        eye = vec3_muladds(front, 20.0f * sim.dt, eye);
     }
     if (keys[SDL_SCANCODE_S]) {
-        eye = vec3_mulsubs(front, 20.0f * DT, eye);
+        eye = vec3_mulsubs(front, 20.0f * sim.dt, eye);
     }
     if (keys[SDL_SCANCODE_A]) {
-        eye = vec3_mulsubs(right, 20.0f * DT, eye);
+        eye = vec3_mulsubs(right, 20.0f * sim.dt, eye);
     }
     if (keys[SDL_SCANCODE_D]) {
-        eye = vec3_muladds(right, 20.0f * DT, eye);
+        eye = vec3_muladds(right, 20.0f * sim.dt, eye);
+    }
+}
+
+/* the backend in use and how long its steps took over the last second */
+static void show_step_time(Uint64 ticks, int steps, Uint64 freq) {
+    char title[128];
+    snprintf(title, sizeof(title), "Many Objects - %s - %.0f us per step", 
+             sim.backend->name, steps ? 1e6 * ticks / freq / steps : 0.0);
+    SDL_SetWindowTitle(wnd, title);
+}
+
+/* keys 1 to 9 switch to the backends given with -b */
+static void switch_backend(SDL_Keycode key) {
+    int k = key - SDLK_1;
+    if (k >= 0 && k < sim.n_backends && sim.backends[k] != sim.backend) {
+        use_backend(k);
     }
 }
 
 int main(int argc, char **argv) {
-    init_draw();
     init_sim(argc, argv);
+    init_draw();
     Uint64 freq = SDL_GetPerformanceFrequency();
-    Uint64 frame = freq / SPS;
+    Uint64 frame = freq / sim.sps;
     Uint64 t0 = SDL_GetPerformanceCounter();
     Uint64 acc = 0;
+    Uint64 shown = t0;
+    Uint64 step_ticks = 0;
+    int steps = 0;
     int n_keys;
     keys = SDL_GetKeyboardState(&n_keys);
     SDL_ShowWindow(wnd);
@@ -60,6 +80,8 @@ int main(int argc, char **argv) {
         while (SDL_PollEvent(&ev)) {
             if (ev.type == SDL_QUIT) {
                 running = 0;
+            } else if (ev.type == SDL_KEYDOWN) {
+                switch_backend(ev.key.keysym.sym);
             }
         }
         Uint64 t1 = SDL_GetPerformanceCounter();
@@ -84,7 +106,16 @@ int main(int argc, char **argv) {
         while (acc >= frame) {
             acc -= frame;
             step_eye();
+            Uint64 s0 = SDL_GetPerformanceCounter();
             step_sim();
+            step_ticks += SDL_GetPerformanceCounter() - s0;
+            steps++;
+        }
+        if (t1 - shown >= freq) {
+            show_step_time(step_ticks, steps, freq);
+            shown = t1;
+            step_ticks = 0;
+            steps = 0;
         }
     }
     return EXIT_SUCCESS;
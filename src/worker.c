@@ -1,79 +1,368 @@
+#define _GNU_SOURCE
+#include <limits.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "worker.h"
 #include "misc.h"
+#include "profile.h"
 
-int n_workers = 4;
+#define CACHE_LINE 64
+#define SPIN_COUNT 4096
+#define FAN_IN 4
 
-#define ALL_WORKERS ((1u << n_workers) - 1u)
+int n_workers;
 
-static pthread_mutex_t active_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t active_cond = PTHREAD_COND_INITIALIZER;
+/* 
+ * a word threads wait on, alone on its cache line with the number of
+ * threads parked on it so that wakers can skip the system call
+ */
+struct wait_word {
+    int val;
+    int waiters;
+} __attribute__((aligned(CACHE_LINE)));
+
+/* 
+ * the indices a worker has left in a parallel_for, begin in the low and 
+ * end in the high half so both move together
+ */
+struct index_range {
+    uint64_t bounds;
+} __attribute__((aligned(CACHE_LINE)));
+
+static struct wait_word work_gen;
+static struct wait_word *subtree_done;
+static struct index_range *ranges;
+static int for_grain;
+static void(*for_fn)(int, int, int, void *);
+static void *for_ctx;
+static int workers_active __attribute__((aligned(CACHE_LINE)));
 static pthread_t *workers;
-static unsigned workers_started;
-static unsigned workers_done;
 static void(*current_work)(int);
-static int workers_active;
 
 static int load(int *val) {
     return __atomic_load_n(val, __ATOMIC_SEQ_CST);
 }
 
-static void restloop(void) {
-    pthread_mutex_lock(&active_mutex);
-    while (!workers_active) {
-        pthread_cond_wait(&active_cond, &active_mutex);
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+/* 
+ * spin a while for w to change from old if the workers are active, then
+ * park on a futex, the waiter count and the value are both sequentially
+ * consistent so either the waker sees the waiter or the waiter the value
+ */
+static void wait_change(struct wait_word *w, int old) {
+    int spins = load(&workers_active) ? SPIN_COUNT : 0;
+    for (int i = 0; i < spins; i++) {
+        if (load(&w->val) != old) {
+            return;
+        }
+        cpu_relax();
+    }
+    __atomic_add_fetch(&w->waiters, 1, __ATOMIC_SEQ_CST);
+    while (load(&w->val) == old) {
+        syscall(SYS_futex, &w->val, FUTEX_WAIT_PRIVATE, old, NULL, NULL, 0);
     }
-    pthread_mutex_unlock(&active_mutex);
+    __atomic_sub_fetch(&w->waiters, 1, __ATOMIC_SEQ_CST);
 }
 
-static void consume_work(unsigned worker_idx) {
-    unsigned worker_flag = 1u << worker_idx;
-    while (load(&workers_started) & worker_flag);
-    __atomic_or_fetch(&workers_started, worker_flag, __ATOMIC_SEQ_CST);
+static void wake_all(struct wait_word *w) {
+    if (load(&w->waiters)) {
+        syscall(SYS_futex, &w->val, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL,
+                0);
+    }
+}
+
+/* 
+ * the workers form a tree with FAN_IN children per worker, a worker 
+ * waits for the subtrees of its children to finish generation gen and 
+ * then marks its own subtree done, so only a parent and its children 
+ * share a word and worker 0 sees the whole pool finish
+ */
+static void finish_subtree(unsigned worker_idx, int gen) {
+    int first = FAN_IN * worker_idx + 1;
+    for (int c = first; c < first + FAN_IN && c < n_workers; c++) {
+        int done;
+        while ((done = load(&subtree_done[c].val)) != gen) {
+            wait_change(&subtree_done[c], done);
+        }
+    }
+    __atomic_store_n(&subtree_done[worker_idx].val, gen, __ATOMIC_SEQ_CST);
+    wake_all(&subtree_done[worker_idx]);
+}
+
+static void run_work(unsigned worker_idx) {
+    profile_work_begin(worker_idx);
     current_work(worker_idx);
-    __atomic_or_fetch(&workers_done, worker_flag, __ATOMIC_SEQ_CST);
+    profile_work_end(worker_idx);
 }
 
+/* the pool waits for the work generation to move on */
 static void *worker_func(void *arg) {
     unsigned worker_idx = (uintptr_t) arg;
+    int gen = 0;
     while (1) {
-        consume_work(worker_idx);
-        restloop();
+        wait_change(&work_gen, gen);
+        gen = load(&work_gen.val);
+        run_work(worker_idx);
+        finish_subtree(worker_idx, gen);
     }
     return NULL;
 }
 
-void create_workers(void) {
+struct cpu_slot {
+    int cpu;
+    int package;
+    int core;
+    int rank;
+    int thread;
+};
+
+static int read_topology(int cpu, const char *name) {
+    char path[96];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", 
+             cpu, name);
+    FILE *f = fopen(path, "r");
+    int val = -1;
+    if (f) {
+        if (fscanf(f, "%d", &val) != 1) {
+            val = -1;
+        }
+        fclose(f);
+    }
+    return val;
+}
+
+/* sockets, then cores, then SMT siblings */
+static int compare_compact(const void *a, const void *b) {
+    const struct cpu_slot *p = a;
+    const struct cpu_slot *q = b;
+    if (p->package != q->package) {
+        return p->package - q->package;
+    }
+    if (p->rank != q->rank) {
+        return p->rank - q->rank;
+    }
+    return p->thread - q->thread;
+}
+
+/* SMT siblings, then cores, then sockets */
+static int compare_scatter(const void *a, const void *b) {
+    const struct cpu_slot *p = a;
+    const struct cpu_slot *q = b;
+    if (p->thread != q->thread) {
+        return p->thread - q->thread;
+    }
+    if (p->rank != q->rank) {
+        return p->rank - q->rank;
+    }
+    return p->package - q->package;
+}
+
+/* 
+ * the CPUs the process may run on in the order workers are pinned to 
+ * them, cores are ranked within their socket and threads within their 
+ * core as core ids need not be dense
+ */
+static struct cpu_slot *order_cpus(const char *affinity, int *n) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set)) {
+        die("sched_getaffinity failed\n");
+    }
+    struct cpu_slot *slots = xmalloc(CPU_COUNT(&set) * sizeof(*slots));
+    *n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set)) {
+            continue;
+        }
+        struct cpu_slot s = {cpu, read_topology(cpu, "physical_package_id"), 
+                             read_topology(cpu, "core_id"), 0, 0};
+        if (s.package < 0 || s.core < 0) {
+            s.package = 0;
+            s.core = cpu;
+        }
+        for (int k = 0; k < *n; k++) {
+            if (slots[k].package != s.package) {
+                continue;
+            }
+            if (slots[k].core == s.core) {
+                s.thread++;
+                s.rank = slots[k].rank;
+            } else if (!slots[k].thread && !s.thread) {
+                s.rank++;
+            }
+        }
+        slots[(*n)++] = s;
+    }
+    qsort(slots, *n, sizeof(*slots), 
+          strcmp(affinity, "compact") ? compare_scatter : compare_compact);
+    return slots;
+}
+
+static void pin_attr(pthread_attr_t *attr, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    if (err) {
+        die("pthread_attr_setaffinity_np: %s\n", strerror(err));
+    }
+}
+
+/* 
+ * one worker per online CPU unless n_workers was set, pinned in compact 
+ * or scatter order if affinity is given, the calling thread is worker 0
+ */
+void create_workers(const char *affinity) {
+    struct cpu_slot *cpus = NULL;
+    int n_cpus = 0;
+    if (affinity) {
+        if (strcmp(affinity, "compact") && strcmp(affinity, "scatter")) {
+            die("unknown affinity %s\n", affinity);
+        }
+        cpus = order_cpus(affinity, &n_cpus);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[0].cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err) {
+            die("pthread_setaffinity_np: %s\n", strerror(err));
+        }
+    }
+    if (n_workers <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        n_workers = n > 0 ? n : 1;
+    }
+    subtree_done = xaligned_alloc(CACHE_LINE, 
+                                  n_workers * sizeof(*subtree_done));
+    memset(subtree_done, 0, n_workers * sizeof(*subtree_done));
+    ranges = xaligned_alloc(CACHE_LINE, n_workers * sizeof(*ranges));
     workers = xmalloc(n_workers * sizeof(*workers));
-    workers_started = ALL_WORKERS;
-    for (uintptr_t i = 1; i < n_workers; i++) {
+    for (int i = 1; i < n_workers; i++) {
         pthread_t *worker = &workers[i - 1];
-        int err = pthread_create(worker, NULL, worker_func, (void *) i);
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (cpus) {
+            pin_attr(&attr, cpus[i % n_cpus].cpu);
+        }
+        int err = pthread_create(worker, &attr, worker_func, 
+                                 (void *) (uintptr_t) i);
         if (err) {
             die("pthread_create: %s\n", strerror(err));
         }
+        pthread_attr_destroy(&attr);
     }
+    free(cpus);
 }
 
+/* the span from starting the work to the last worker finishing is timed */
 void parallel_work(void(*work)(int)) {
+    profile_span_begin();
     current_work = work;
-    workers_done = 0;
-    __atomic_store_n(&workers_started, 0, __ATOMIC_SEQ_CST);
-    consume_work(0);
-    while (load(&workers_done) != ALL_WORKERS); 
+    int gen = __atomic_add_fetch(&work_gen.val, 1, __ATOMIC_SEQ_CST);
+    wake_all(&work_gen);
+    run_work(0);
+    finish_subtree(0, gen);
+    profile_span_end();
+}
+
+static uint64_t pack_range(int begin, int end) {
+    return (uint32_t) begin | (uint64_t) end << 32;
+}
+
+/* take up to for_grain indices off the front of the range of worker w */
+static int pop_chunk(int w, int *begin, int *end) {
+    uint64_t *bounds = &ranges[w].bounds;
+    uint64_t old = __atomic_load_n(bounds, __ATOMIC_SEQ_CST);
+    while (1) {
+        int b = (uint32_t) old;
+        int e = old >> 32;
+        if (b >= e) {
+            return 0;
+        }
+        int m = e - b > for_grain ? b + for_grain : e;
+        if (__atomic_compare_exchange_n(bounds, &old, pack_range(m, e), 0, 
+                                        __ATOMIC_SEQ_CST, 
+                                        __ATOMIC_SEQ_CST)) {
+            *begin = b;
+            *end = m;
+            return 1;
+        }
+    }
+}
+
+/* 
+ * move the back half of the range of the next busy worker to the range 
+ * of worker w, which is empty, so only thieves race with the owner 
+ */
+static int steal_range(int w) {
+    for (int k = 1; k < n_workers; k++) {
+        uint64_t *bounds = &ranges[(w + k) % n_workers].bounds;
+        uint64_t old = __atomic_load_n(bounds, __ATOMIC_SEQ_CST);
+        while (1) {
+            int b = (uint32_t) old;
+            int e = old >> 32;
+            if (b >= e) {
+                break;
+            }
+            int m = b + (e - b) / 2;
+            if (__atomic_compare_exchange_n(bounds, &old, pack_range(b, m), 
+                                            0, __ATOMIC_SEQ_CST, 
+                                            __ATOMIC_SEQ_CST)) {
+                __atomic_store_n(&ranges[w].bounds, pack_range(m, e), 
+                                 __ATOMIC_SEQ_CST);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void parallel_for_worker(int worker_idx) {
+    int begin, end;
+    while (pop_chunk(worker_idx, &begin, &end) || 
+           (steal_range(worker_idx) && 
+            pop_chunk(worker_idx, &begin, &end))) {
+        for_fn(worker_idx, begin, end, for_ctx);
+    }
+}
+
+/* 
+ * call fn on chunks of at most grain indices of begin up to end, every 
+ * worker starts on an equal share and steals half of the share of 
+ * another once it is done with its own, a range that is moving between 
+ * workers is finished by the one taking it
+ */
+void parallel_for(int begin, int end, int grain, 
+                  void(*fn)(int, int, int, void *), void *ctx) {
+    for_grain = grain > 0 ? grain : 1;
+    for_fn = fn;
+    for_ctx = ctx;
+    long n = end - begin;
+    for (int w = 0; w < n_workers; w++) {
+        ranges[w].bounds = pack_range(begin + w * n / n_workers, 
+                                      begin + (w + 1) * n / n_workers);
+    }
+    parallel_work(parallel_for_worker);
 }
 
+/* workers spin between the phases of a step and park outside of them */
 void activate_workers(void) {
-    pthread_mutex_lock(&active_mutex);
-    workers_active = 1;
-    pthread_mutex_unlock(&active_mutex);
-    pthread_cond_broadcast(&active_cond);
+    __atomic_store_n(&workers_active, 1, __ATOMIC_SEQ_CST);
 }
 
 void deactivate_workers(void) {
-    pthread_mutex_lock(&active_mutex);
-    workers_active = 0;
-    pthread_mutex_unlock(&active_mutex);
+    __atomic_store_n(&workers_active, 0, __ATOMIC_SEQ_CST);
 }
@@ -2,7 +2,9 @@
 
 extern int n_workers;
 
-void create_workers(void);
+void create_workers(const char *affinity);
 void parallel_work(void(*work)(int));
+void parallel_for(int begin, int end, int grain, 
+                  void(*fn)(int, int, int, void *), void *ctx);
 void activate_workers(void);
 void deactivate_workers(void);
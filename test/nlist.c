@@ -0,0 +1,65 @@
+/* 
+ * the neighbour lists of bin/bench-mt hold every pair closer than
+ * diameter plus skin at the positions saved when they are built, even
+ * if a pass of the step that builds them pushes a ball almost half the
+ * skin away, the backend is included so its lists can be checked
+ */
+#include "sim-mt.c"
+
+static int in_lists(int i, int j) {
+    for (int k = 0; k < sim.n_passes * n_workers; k++) {
+        const struct pair_list *list = &pair_lists[k];
+        for (int p = 0; p < list->n; p++) {
+            int a = list->pairs[p].i;
+            int b = list->pairs[p].j;
+            if ((a == i && b == j) || (a == j && b == i)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void place(int i, float x, float y, float z, float w) {
+    sim.x.x[i] = x;
+    sim.x.y[i] = y;
+    sim.x.z[i] = z;
+    sim.v.x[i] = sim.v.y[i] = sim.v.z[i] = 0.0f;
+    sim.r[i] = sim.radius;
+    sim.w[i] = w;
+}
+
+/* 
+ * ball 1 overlaps ball 0 by 0.18, just under half the skin of 0.4, across 
+ * a cell face * along z, it does not move so ball 0 takes the whole correction in an
+ * earlier pass than the one pairing it with ball 2 across a face along
+ * x, which pushes ball 0 from 0.95 to 1.07 away from ball 2
+ */
+int main(void) {
+    char *argv[] = {"test-nlist", "-n", "3", "-g", "8", "-r", "0.3", 
+                    "-K", "0.4", "-w", "1", NULL};
+    init_sim(sizeof(argv) / sizeof(*argv) - 1, argv);
+    place(0, 0.3f, 0.5f, 0.3f, 1.0f);
+    place(1, 0.048f, 0.5f, -0.036f, 0.0f);
+    place(2, -0.65f, 0.5f, 0.3f, 1.0f);
+    sim.nlist_valid = 0;
+    step_sim();
+    int failed = 0;
+    for (int i = 0; i < sim.n_balls; i++) {
+        for (int j = i + 1; j < sim.n_balls; j++) {
+            float dx = sim.xb.x[i] - sim.xb.x[j];
+            float dy = sim.xb.y[i] - sim.xb.y[j];
+            float dz = sim.xb.z[i] - sim.xb.z[j];
+            float cutoff = sim.r[i] + sim.r[j] + sim.skin;
+            if (dx * dx + dy * dy + dz * dz < cutoff * cutoff && 
+                !in_lists(i, j)) {
+                printf("pair %d %d missing from the lists\n", i, j);
+                failed = 1;
+            }
+        }
+    }
+    if (!failed) {
+        printf("ok\n");
+    }
+    return failed;
+}